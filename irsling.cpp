@@ -4,8 +4,24 @@
 #include <unordered_set>
 #include <fstream>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <thread>
 #include <getopt.h>
 #include <unistd.h>
+#include <sstream>
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <errno.h>
+#include <glob.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sched.h>
+#include <malloc.h>
 #include "irslinger.h"
 
 // compile with:
@@ -13,7 +29,6 @@
 
 // LIRC config not supported:
 // http://www.lirc.org/html/lircd.conf.html
-// include
 // manual_sort
 // suppress_repeat
 // flags RC6 / RC-MM / REVERSE / NO_HEAD_REP / NO_FOOT_REP / CONST_LENGTH / REPEAT_HEADER
@@ -54,19 +69,155 @@ class remote_config {
 		std::unordered_map<std::string,std::string> codes;
 		// other arbitrary flags
 		std::unordered_set<std::string> flags;
-		// raw codes
-		std::unordered_map<std::string, std::vector<int> > rawcodes;
+		// raw codes: button label -> packed code (irSlingPrepareRawPacked)
+		// buttons with identical codes share one packed string
+		std::unordered_map<std::string, std::shared_ptr<const std::string> > rawcodes;
+		// the distinct raw durations the packed codes refer to
+		std::vector<uint32_t> rawtimings;
+
+		// read only accessors, safe to use on a shared snapshot
+		bool has(const std::string &name) const
+		{
+			return config.find(name) != config.end();
+		}
+		int get(const std::string &name) const
+		{
+			auto i = config.find(name);
+			return (i == config.end()) ? 0 : i->second;
+		}
+		bool has_flag(const std::string &name) const
+		{
+			return flags.find(name) != flags.end();
+		}
+		// true if the parsed content matches
+		bool same_as(const remote_config &other) const
+		{
+			return (config == other.config) &&
+			       (codes == other.codes) &&
+			       (flags == other.flags) &&
+			       (rawtimings == other.rawtimings) &&
+			       same_rawcodes(other);
+		}
+		// heap held by the remote, roughly: strings, nodes and buckets
+		size_t heap_bytes() const
+		{
+			const size_t node = 2 * sizeof(void *);
+			size_t bytes = sizeof(*this);
+			bytes += (config.bucket_count() + codes.bucket_count() + flags.bucket_count() + rawcodes.bucket_count()) * sizeof(void *);
+			for (auto &c : config)
+			{
+				bytes += node + sizeof(c) + c.first.capacity();
+			}
+			for (auto &c : codes)
+			{
+				bytes += node + sizeof(c) + c.first.capacity() + c.second.capacity();
+			}
+			for (auto &f : flags)
+			{
+				bytes += node + sizeof(f) + f.capacity();
+			}
+			std::unordered_set<const std::string *> packed;
+			for (auto &r : rawcodes)
+			{
+				bytes += node + sizeof(r) + r.first.capacity();
+				if (packed.insert(r.second.get()).second)
+				{
+					bytes += node + sizeof(std::string) + r.second->capacity();
+				}
+			}
+			bytes += rawtimings.capacity() * sizeof(uint32_t);
+			return bytes;
+		}
+		bool same_rawcodes(const remote_config &other) const
+		{
+			if (rawcodes.size() != other.rawcodes.size())
+			{
+				return false;
+			}
+			for (auto &r : rawcodes)
+			{
+				auto o = other.rawcodes.find(r.first);
+				if ((o == other.rawcodes.end()) || (*o->second != *r.second))
+				{
+					return false;
+				}
+			}
+			return true;
+		}
+};
+
+// an immutable set of remotes; a new snapshot is published on every
+// reload and users keep whichever snapshot they started with
+typedef std::unordered_map<std::string, std::shared_ptr<const remote_config> > remote_map;
+
+// index of a config directory, so remotes can be parsed only when needed
+// what the index knows about one config file
+struct indexed_file {
+	long long mtime = 0;
+	long long size = 0;
+	// remotes defined in the file and the offset of their "begin remote"
+	std::vector<std::pair<std::string, std::streamoff> > remotes;
+	// files pulled in with include
+	std::vector<std::string> includes;
 };
+// where to find a remote
+struct index_entry {
+	std::string file;
+	std::streamoff offset;
+};
+struct config_index {
+	// path -> contents
+	std::unordered_map<std::string, indexed_file> files;
+	// remote name -> location
+	std::unordered_map<std::string, index_entry> remotes;
+	// files included by the -f config files, so they can be watched too
+	std::vector<std::string> included;
+};
+
+struct config_snapshot {
+	// remotes parsed so far
+	remote_map remotes;
+	// remotes that can be loaded on demand from config directories
+	std::shared_ptr<const config_index> index = std::make_shared<config_index>();
+};
+
+// the current snapshot, only ever accessed with std::atomic_load/store
+std::shared_ptr<const config_snapshot> current_config = std::make_shared<config_snapshot>();
+
+std::shared_ptr<const config_snapshot> current_remotes()
+{
+	return std::atomic_load(&current_config);
+}
 
-// map of config for each known remote
-std::unordered_map<std::string, remote_config> remotes;
+// config files and directories named on the command line, in order
+std::vector<std::string> config_files;
+
+// name of the persisted index within a config directory
+const char * index_filename = ".irsling.index";
+// how deep include may nest before we assume a loop
+const int max_include_depth = 16;
 
 // statefulness while parsing remote
-bool in_codes = false;
-std::string remotename = "default";
-bool in_rawcodes = false;
-std::string buttonname;
+struct parse_state {
+	parse_state(std::unordered_map<std::string, remote_config> &r) : remotes(r) {}
+	// remotes being built up by this parse
+	std::unordered_map<std::string, remote_config> &remotes;
+	bool in_codes = false;
+	std::string remotename = "default";
+	bool in_rawcodes = false;
+	std::string buttonname;
+	// durations of the raw button being read, packed once it is complete
+	std::vector<int> rawpending;
+	// file being parsed, includes are relative to it
+	std::string filename;
+	int depth = 0;
+	// set when "end remote" is seen
+	bool remote_ended = false;
+	// where to note every file pulled in with include, if anywhere
+	std::vector<std::string> *included = nullptr;
+};
 
+int parse_config(parse_state &state, const char * filename);
 
 void tokenise(const std::string in, const char * delimiters, std::vector<std::string> &out)
 {
@@ -83,8 +234,129 @@ void tokenise(const std::string in, const char * delimiters, std::vector<std::st
 	}
 }
 
+// split a path into directory and file name
+static void split_path(const std::string &path, std::string &dir, std::string &file)
+{
+	size_t slash = path.rfind('/');
+	if (slash == std::string::npos)
+	{
+		dir = ".";
+		file = path;
+	}
+	else
+	{
+		dir = (slash == 0) ? "/" : path.substr(0, slash);
+		file = path.substr(slash + 1);
+	}
+}
+
+// expand the argument of an include line into the files it names
+// "file" and <file> are both relative to the including file, and may glob
+void resolve_include(const std::string &from, std::string arg, std::vector<std::string> &out)
+{
+	if ((arg.size() >= 2) &&
+	    (((arg.front() == '"') && (arg.back() == '"')) ||
+	     ((arg.front() == '<') && (arg.back() == '>'))))
+	{
+		arg = arg.substr(1, arg.size() - 2);
+	}
+	if (arg.empty())
+	{
+		return;
+	}
+	if (arg[0] != '/')
+	{
+		std::string dir, file;
+		split_path(from, dir, file);
+		arg = dir + "/" + arg;
+	}
+
+	glob_t g;
+	if (glob(arg.c_str(), 0, nullptr, &g) == 0)
+	{
+		for (size_t i = 0; i < g.gl_pathc; ++i)
+		{
+			out.push_back(g.gl_pathv[i]);
+		}
+	}
+	else
+	{
+		// no match, let the open fail and report it
+		out.push_back(arg);
+	}
+	globfree(&g);
+}
+
+int parse_include(parse_state &state, const std::string &arg)
+{
+	if (state.depth >= max_include_depth)
+	{
+		std::cerr << "Includes nested too deeply in "<<state.filename<<std::endl;
+		return -1;
+	}
+	std::vector<std::string> files;
+	resolve_include(state.filename, arg, files);
+	for (auto &f : files)
+	{
+		if (state.included != nullptr)
+		{
+			state.included->push_back(f);
+		}
+		std::string from = state.filename;
+		state.depth++;
+		int ret = parse_config(state, f.c_str());
+		state.depth--;
+		state.filename = from;
+		if (ret)
+		{
+			std::cerr << "Failed to include "<<f<<" from "<<from<<std::endl;
+			return -1;
+		}
+	}
+	return 0;
+}
+
+// pack raw durations against the remote's timing table
+// (the format is described with irSlingUnpackRaw)
+std::string pack_raw(const std::vector<int> &durations, std::vector<uint32_t> &timings)
+{
+	size_t numTimings = timings.size();
+	timings.resize(numTimings + durations.size());
+	std::string packed(durations.size() * 5, '\0');
+	int len = irSlingPackRaw(durations.data(), durations.size(),
+		timings.data(), &numTimings, timings.size(),
+		(uint8_t *)&packed[0], packed.size());
+	timings.resize(numTimings);
+	packed.resize(len);
+	packed.shrink_to_fit();
+	return packed;
+}
+
+// store the raw button read so far
+void flush_raw(parse_state &state)
+{
+	if (state.rawpending.empty())
+	{
+		return;
+	}
+	remote_config &remote(state.remotes[state.remotename]);
+	std::string packed = pack_raw(state.rawpending, remote.rawtimings);
+	state.rawpending.clear();
+
+	// share the packed code with any identical button
+	for (auto &r : remote.rawcodes)
+	{
+		if (*r.second == packed)
+		{
+			remote.rawcodes[state.buttonname] = r.second;
+			return;
+		}
+	}
+	remote.rawcodes[state.buttonname] = std::make_shared<const std::string>(std::move(packed));
+}
+
 const char * space_delimiters = " \t\r\n";
-int handle_line(const std::string & line)
+int handle_line(parse_state &state, const std::string & line)
 {
 	// tokenise the line
 	std::vector<std::string> tokens;
@@ -107,7 +379,7 @@ int handle_line(const std::string & line)
 		++i;
 	}
 	// all lines in >=2 tokens unless we are in raw codes
-	if ((maxtoken == 0) && (in_rawcodes == false))
+	if ((maxtoken == 0) && (state.in_rawcodes == false))
 	{
 		std::cerr << "Invalid line: "<<line<<std::endl;
 		return -1;
@@ -122,21 +394,26 @@ int handle_line(const std::string & line)
 	}
 	if (tokens[0] == "end" && tokens[1] == "remote")
 	{
-		// no action required
+		state.remote_ended = true;
 		return 0;
 	}
+	if (tokens[0] == "include")
+	{
+		return parse_include(state, tokens[1]);
+	}
 	if (tokens[0] == "name")
 	{
-		if (in_rawcodes)
+		if (state.in_rawcodes)
 		{
-			buttonname = tokens[1];
+			flush_raw(state);
+			state.buttonname = tokens[1];
 		} else {
-			remotename = tokens[1];
+			state.remotename = tokens[1];
 		}
 		return 0;
 	}
 
-	remote_config &remote(remotes[remotename]);
+	remote_config &remote(state.remotes[state.remotename]);
 
 	if (tokens[0] == "flags")
 	{
@@ -197,35 +474,36 @@ int handle_line(const std::string & line)
 		}
 		if (tokens[0] == "begin" && tokens[1] == "codes")
 		{
-			in_codes = true;
-			in_rawcodes = false;
+			state.in_codes = true;
+			state.in_rawcodes = false;
 			return 0;
 		}
 		if (tokens[0] == "begin" && tokens[1] == "raw_codes")
 		{
-			in_codes = false;
-			in_rawcodes = true;
+			state.in_codes = false;
+			state.in_rawcodes = true;
 			return 0;
 		}
 		if (tokens[0] == "end" && tokens[1] == "codes")
 		{
-			in_codes = false;
+			state.in_codes = false;
 			return 0;
 		}
 		if (tokens[0] == "end" && tokens[1] == "raw_codes")
 		{
-			in_rawcodes = false;
+			flush_raw(state);
+			state.in_rawcodes = false;
 			return 0;
 		}
-		if (in_rawcodes)
+		if (state.in_rawcodes)
 		{
 			for(auto r:tokens)
 			{
-				remote.rawcodes[buttonname].push_back(std::stoi(r,nullptr,0));
+				state.rawpending.push_back(std::stoi(r,nullptr,0));
 			}
 			return 0;
 		}
-		if (in_codes)
+		if (state.in_codes)
 		{
 			// TODO what if bits is not multiple of 4?
 			//snprintf(xx,sizeof(xx),"%0*x",(3+remote.config["bits"])/4,std::stoi(tokens[1],nullptr,0));
@@ -245,7 +523,7 @@ int handle_line(const std::string & line)
 	return 0;
 }
 
-int parse_config(const char * filename)
+int parse_config(parse_state &state, const char * filename)
 {
 	if (filename == nullptr)
 	{
@@ -253,302 +531,2140 @@ int parse_config(const char * filename)
 	}
 
 	std::ifstream configfile(filename);
+	if (!configfile.is_open())
+	{
+		return 1;
+	}
+	state.filename = filename;
 
+	// keep going after a bad line so every error in the file is reported
+	int failed = 0;
 	while (configfile.good())
 	{
 		std::string line;
 		std::getline(configfile,line);
-		handle_line(line);
+		if (handle_line(state, line))
+		{
+			failed = 1;
+		}
 	}
+	// a raw code left open at the end of the file
+	flush_raw(state);
 
-	return 0;
+	return failed;
 }
 
-// -p pin
-// -f config
-// * button name(s)
-int main(int argc, char *argv[])
+static bool is_directory(const std::string &path)
 {
-	const char * configfile = nullptr;
-	int pin = 23;
-	int c ;
-	bool dumpconfig=false;
-	std::string thisremote;
-	std::string defaultremote;
-	while( ( c = getopt (argc, argv, "r:dp:f:") ) != -1 ) 
+	struct stat st;
+	return (stat(path.c_str(), &st) == 0) && S_ISDIR(st.st_mode);
+}
+
+// parse just the remote starting at offset in filename
+int parse_remote_at(std::unordered_map<std::string, remote_config> &out, const std::string &filename, std::streamoff offset)
+{
+	std::ifstream configfile(filename);
+	if (!configfile.is_open())
 	{
-		switch(c)
+		return 1;
+	}
+	configfile.seekg(offset);
+
+	parse_state state(out);
+	state.filename = filename;
+	int failed = 0;
+	while (configfile.good() && !state.remote_ended)
+	{
+		std::string line;
+		std::getline(configfile,line);
+		if (handle_line(state, line))
 		{
-			case 'd':
-				dumpconfig = true;
-				break;
-			case 'f':
-				if (parse_config(optarg))
-				{
-					std::cerr<<"Failed to parse config from "<<optarg<<std::endl;
-					exit(1);
-				}
-				break;
-			case 'p':
-				if(optarg) pin = std::atoi(optarg) ;
-				break;
-			case 'r':
-				if(optarg) defaultremote = optarg;
-				break;
-			default:
-				std::cerr<<"Unexpected argument "<<c<<std::endl
-				         <<"Valid arguments are:"<<std::endl
-					 <<"    -p pinnumber"<<std::endl
-					 <<"    -f lircremotefile"<<std::endl
-					 <<"    -r defaultremotename"<<std::endl
-					 <<"    -d = dumpconfig"<<std::endl
-					 <<"     button button button... or"<<std::endl
-					 <<"     remotename.button remotename.button..."<<std::endl;
-				exit(1);
-		}			    
+			failed = 1;
+		}
 	}
-	if (remotes.size() == 0)
+	flush_raw(state);
+	return failed;
+}
+
+// find the remotes and includes in a file without parsing any codes
+int scan_file(const std::string &filename, indexed_file &entry)
+{
+	std::ifstream configfile(filename);
+	if (!configfile.is_open())
 	{
-		std::cerr<<"No remotes defined!" << std::endl;
-		exit(1);
+		return 1;
 	}
 
-	// if only one remote defined then use that
-	if ((remotes.size() == 1) && (thisremote.size() == 0))
+	bool in_remote = false;
+	bool in_codes = false;
+	std::string name;
+	std::streamoff begin = 0;
+	while (configfile.good())
 	{
-		defaultremote = remotes.begin()->first;
+		std::streamoff offset = configfile.tellg();
+		std::string line;
+		std::getline(configfile,line);
+		std::vector<std::string> tokens;
+		tokenise(line, space_delimiters, tokens);
+		if ((tokens.size() < 2) || (tokens[0].at(0) == '#'))
+		{
+			continue;
+		}
+		if (tokens[0] == "include")
+		{
+			resolve_include(filename, tokens[1], entry.includes);
+		}
+		else if (tokens[0] == "begin" && tokens[1] == "remote")
+		{
+			in_remote = true;
+			in_codes = false;
+			name = "default";
+			begin = offset;
+		}
+		else if (tokens[0] == "end" && tokens[1] == "remote" && in_remote)
+		{
+			entry.remotes.push_back(std::make_pair(name, begin));
+			in_remote = false;
+		}
+		else if (tokens[0] == "begin")
+		{
+			// name lines inside raw_codes are buttons
+			in_codes = true;
+		}
+		else if (tokens[0] == "end")
+		{
+			in_codes = false;
+		}
+		else if ((tokens[0] == "name") && in_remote && !in_codes)
+		{
+			name = tokens[1];
+		}
 	}
+	return 0;
+}
 
-	if (dumpconfig)
+// paths in the persisted index are relative to its directory, so the
+// index holds however the directory is named on the command line
+static std::string index_path_out(const std::string &dir, const std::string &path)
+{
+	std::string prefix = dir + "/";
+	return (path.compare(0, prefix.size(), prefix) == 0) ? path.substr(prefix.size()) : path;
+}
+static std::string index_path_in(const std::string &dir, const std::string &path)
+{
+	return ((path.size() > 0) && (path[0] == '/')) ? path : (dir + "/" + path);
+}
+
+// read the persisted index of a config directory, if there is one
+void read_index(const std::string &dir, config_index &index)
+{
+	std::ifstream in(dir + "/" + index_filename);
+	std::string line;
+	if (!std::getline(in, line) || (line != "irsling-index 2"))
 	{
-		for (auto r:remotes)
+		return;
+	}
+	indexed_file *file = nullptr;
+	while (std::getline(in, line))
+	{
+		std::istringstream fields(line);
+		std::string kind;
+		fields >> kind;
+		if (kind == "file")
 		{
-			remote_config &remote(r.second);
-			std::cout <<"Config for remote "<<r.first<<std::endl;
-			for (auto k:remote.config)
-			{
-				std::cout << "config: "<<k.first<<" "<<k.second<<std::endl;
-			}
-			for (auto k:remote.codes)
+			long long mtime, size;
+			std::string path;
+			fields >> mtime >> size >> std::ws;
+			std::getline(fields, path);
+			file = &index.files[index_path_in(dir, path)];
+			file->mtime = mtime;
+			file->size = size;
+		}
+		else if ((kind == "remote") && (file != nullptr))
+		{
+			std::streamoff offset;
+			std::string name;
+			fields >> offset >> name;
+			file->remotes.push_back(std::make_pair(name, offset));
+		}
+		else if ((kind == "include") && (file != nullptr))
+		{
+			std::string path;
+			fields >> std::ws;
+			std::getline(fields, path);
+			file->includes.push_back(index_path_in(dir, path));
+		}
+	}
+}
+
+// persist the index, replacing the old one atomically
+// a read only config directory simply goes without
+void write_index(const std::string &dir, const config_index &index)
+{
+	std::string path = dir + "/" + index_filename;
+	std::string tmp = path + ".tmp";
+	{
+		std::ofstream out(tmp);
+		if (!out.is_open())
+		{
+			return;
+		}
+		out << "irsling-index 2" << std::endl;
+		for (auto &f : index.files)
+		{
+			out << "file " << f.second.mtime << " " << f.second.size << " " << index_path_out(dir, f.first) << std::endl;
+			for (auto &r : f.second.remotes)
 			{
-				std::cout << "code  : "<<k.first<<" "<<k.second<<std::endl;
+				out << "remote " << r.second << " " << r.first << std::endl;
 			}
-			for (auto k:remote.rawcodes)
+			for (auto &i : f.second.includes)
 			{
-				std::cout << "raw   : "<<k.first;
-				for (auto l:k.second)
-				{
-					std::cout<<" "<<l;
-				}
-				std::cout<<std::endl;
+				out << "include " << index_path_out(dir, i) << std::endl;
 			}
 		}
+		if (!out.good())
+		{
+			unlink(tmp.c_str());
+			return;
+		}
 	}
+	rename(tmp.c_str(), path.c_str());
+}
 
-	int result = -1;
-	transmitWavePre(pin);
-	for (c=optind ; c < argc ; ++c)
+// bring the index for a config directory up to date
+// only files whose size or modification time changed are rescanned
+void index_directory(std::string dir, config_index &index)
+{
+	while ((dir.size() > 1) && (dir.back() == '/'))
 	{
-		// try to break button into remote.button
-		std::string button;
-		char * dot = strchr(argv[c],'.');
-		if (dot == nullptr)
+		dir.pop_back();
+	}
+	config_index old;
+	read_index(dir, old);
+
+	std::vector<std::string> pending;
+	DIR *d = opendir(dir.c_str());
+	if (d == nullptr)
+	{
+		std::cerr<<"Failed to read directory "<<dir<<": "<<strerror(errno)<<std::endl;
+		return;
+	}
+	while (struct dirent *e = readdir(d))
+	{
+		if (e->d_name[0] != '.')
 		{
-			// no remote mentioned
-			thisremote = defaultremote;
-			button = argv[c];
+			pending.push_back(dir + "/" + e->d_name);
 		}
-		else
+	}
+	closedir(d);
+	std::sort(pending.begin(), pending.end());
+	// files are visited in order, included files straight after their includer
+	std::reverse(pending.begin(), pending.end());
+
+	bool changed = false;
+	std::unordered_set<std::string> seen;
+	while (!pending.empty())
+	{
+		std::string path = pending.back();
+		pending.pop_back();
+		if (!seen.insert(path).second)
 		{
-			thisremote = std::string(argv[c],dot - argv[c]);
-			button = dot+1;
+			continue;
 		}
 
-		if (remotes.find(thisremote) == remotes.end())
+		struct stat st;
+		if ((stat(path.c_str(), &st) != 0) || !S_ISREG(st.st_mode))
 		{
-			std::cerr << "Remote " << thisremote << " does not exist" << std::endl;
-			exit(1);
+			continue;
 		}
-		remote_config &remote(remotes[thisremote]);
-
-		gpioPulse_t irSignal[MAX_PULSES];
-		unsigned int pulseCount = 0;
+		long long mtime = (long long)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
 
-		if (remote.flags.find("RAW_CODES") != remote.flags.end())
+		indexed_file entry;
+		auto prev = old.files.find(path);
+		if ((prev != old.files.end()) && (prev->second.mtime == mtime) && (prev->second.size == st.st_size))
 		{
-			std::unordered_map<std::string,std::vector<int>>::iterator raw = remote.rawcodes.find(button);
-			if (raw == remote.rawcodes.end())
-			{
-				std::cerr << "Button \"" << button << "\" is unknown on remote " << thisremote << std::endl;
-				result |= 1;
-				continue;
-			}
-			if (result == -1) { result = 0; }
-			int pulses[raw->second.size()];
-			int j = 0;
-			for (auto r:raw->second)
-			{
-				pulses[j++] = r;
-			}
-			// ensure we always end in an off
-			if ((j % 2) == 1)
-			{
-				pulses[j] = pulses[j-1];
-			}
-			if (irSlingPrepareRaw(irSignal, &pulseCount,
-						pin,
-						remote.config["frequency"],
-						double(remote.config["dutycycle"])/100,
-						pulses,
-						raw->second.size()))
-			{
-				std::cerr << "Failed to prepare signal" <<std::endl;
-				continue;
-			}
+			entry = prev->second;
 		}
 		else
 		{
-			std::unordered_map<std::string,std::string>::iterator code = remote.codes.find(button);
-			if (code == remote.codes.end())
+			entry.mtime = mtime;
+			entry.size = st.st_size;
+			if (scan_file(path, entry))
 			{
-				std::cerr << "Button \"" << button << "\" is unknown on remote " << thisremote << std::endl;
-				result |= 1;
 				continue;
 			}
-			if (result == -1) { result = 0; }
+			changed = true;
+		}
 
-			// nec type
-			if (remote.flags.find("SPACE_ENC") != remote.flags.end())
-			{
-				// insert the header
-				if (irSlingPrepare(irSignal, &pulseCount,
-							pin,
-							remote.config["frequency"],
-							double(remote.config["dutycycle"])/100,
-							remote.config["header.on"],
-							remote.config["header.off"],
-							0, 0, 0, 0, 0, nullptr, 0)) // no more content
-				{
-					std::cerr << "Failed to prepare header" <<std::endl;
-					continue;
-				}
+		for (auto &r : entry.remotes)
+		{
+			// first definition wins
+			index.remotes.insert(std::make_pair(r.first, index_entry{path, r.second}));
+		}
+		for (auto i = entry.includes.rbegin(); i != entry.includes.rend(); ++i)
+		{
+			pending.push_back(*i);
+		}
+		index.files[path] = entry;
+	}
 
-				// insert the pre-data
-				if ((remote.config.find("pre_data") != remote.config.end()) &&
-					(remote.config.find("pre_data_bits") != remote.config.end()))
+	if (changed || (index.files.size() != old.files.size()))
+	{
+		write_index(dir, index);
+	}
+}
+
+// call fn for every index below count, shared out across a thread per core
+// (the calling thread being one of them); returns the number of threads
+unsigned int run_parallel(size_t count, const std::function<void(size_t)> &fn)
+{
+	std::atomic<size_t> next(0);
+	auto worker = [&]() {
+		for (size_t i = next++; i < count; i = next++)
+		{
+			fn(i);
+		}
+	};
+
+	unsigned int threads = std::max(1u, std::min<unsigned int>(std::thread::hardware_concurrency(), count));
+	std::vector<std::thread> pool;
+	for (unsigned int t = 1; t < threads; ++t)
+	{
+		pool.push_back(std::thread(worker));
+	}
+	worker();
+	for (auto &t : pool)
+	{
+		t.join();
+	}
+	return threads;
+}
+
+// parse the named remotes from their indexed locations into out
+// the files are shared out across a thread per core
+// a remote that fails to parse is left out and 1 returned
+int load_indexed(const config_index &index, const std::unordered_set<std::string> &names, std::unordered_map<std::string, remote_config> &out)
+{
+	// file -> offsets of the remotes needed from it
+	std::unordered_map<std::string, std::vector<std::streamoff> > files;
+	for (auto &n : names)
+	{
+		auto e = index.remotes.find(n);
+		if (e != index.remotes.end())
+		{
+			files[e->second.file].push_back(e->second.offset);
+		}
+	}
+
+	std::vector<std::pair<std::string, std::vector<std::streamoff> > > work(files.begin(), files.end());
+	std::vector<std::unordered_map<std::string, remote_config> > parsed(work.size());
+	std::atomic<int> failed(0);
+	run_parallel(work.size(), [&](size_t i) {
+		for (auto o : work[i].second)
+		{
+			std::unordered_map<std::string, remote_config> one;
+			if (parse_remote_at(one, work[i].first, o))
+			{
+				std::cerr<<"Failed to parse config from "<<work[i].first<<std::endl;
+				failed = 1;
+				continue;
+			}
+			for (auto &r : one)
+			{
+				parsed[i][r.first] = std::move(r.second);
+			}
+		}
+	});
+
+	for (auto &p : parsed)
+	{
+		for (auto &r : p)
+		{
+			if (names.count(r.first) > 0)
+			{
+				out[r.first] = std::move(r.second);
+			}
+		}
+	}
+	return failed;
+}
+
+// serialises writers; readers never take it
+std::mutex publish_lock;
+
+// publish freshly parsed remotes as the new snapshot
+// remotes whose content did not change keep their existing config object,
+// so only changed remotes look new to anything caching
+// with index set the parsed remotes replace the whole snapshot, otherwise
+// they are added to it provided the index they came from is still current
+bool publish_config(std::unordered_map<std::string, remote_config> &parsed,
+	std::shared_ptr<const config_index> index,
+	std::shared_ptr<const config_index> from_index = nullptr)
+{
+	std::lock_guard<std::mutex> lock(publish_lock);
+	std::shared_ptr<const config_snapshot> old = current_remotes();
+	std::shared_ptr<config_snapshot> snap = std::make_shared<config_snapshot>();
+	if (index == nullptr)
+	{
+		if (old->index != from_index)
+		{
+			// reloaded while we were parsing
+			return false;
+		}
+		snap->remotes = old->remotes;
+		snap->index = old->index;
+	}
+	else
+	{
+		snap->index = index;
+	}
+	for (auto &r : parsed)
+	{
+		auto prev = old->remotes.find(r.first);
+		if ((prev != old->remotes.end()) && prev->second->same_as(r.second))
+		{
+			snap->remotes[r.first] = prev->second;
+			continue;
+		}
+		snap->remotes[r.first] = std::make_shared<const remote_config>(std::move(r.second));
+	}
+	std::atomic_store(&current_config, std::shared_ptr<const config_snapshot>(snap));
+	return true;
+}
+
+// make sure the named remotes are parsed, loading any that are only indexed
+void load_remotes(const std::unordered_set<std::string> &names)
+{
+	while (true)
+	{
+		std::shared_ptr<const config_snapshot> snap = current_remotes();
+		std::unordered_set<std::string> missing;
+		for (auto &n : names)
+		{
+			if ((snap->remotes.find(n) == snap->remotes.end()) &&
+			    (snap->index->remotes.find(n) != snap->index->remotes.end()))
+			{
+				missing.insert(n);
+			}
+		}
+		if (missing.empty())
+		{
+			return;
+		}
+		std::unordered_map<std::string, remote_config> parsed;
+		load_indexed(*snap->index, missing, parsed);
+		if (publish_config(parsed, nullptr, snap->index))
+		{
+			return;
+		}
+	}
+}
+
+// look up a remote, parsing it on first use
+std::shared_ptr<const remote_config> find_remote(const std::string &name)
+{
+	std::shared_ptr<const config_snapshot> snap = current_remotes();
+	auto r = snap->remotes.find(name);
+	if (r != snap->remotes.end())
+	{
+		return r->second;
+	}
+	load_remotes(std::unordered_set<std::string>{name});
+	snap = current_remotes();
+	r = snap->remotes.find(name);
+	return (r == snap->remotes.end()) ? nullptr : r->second;
+}
+
+// every remote name known, parsed or not
+std::unordered_set<std::string> remote_names(const config_snapshot &snap)
+{
+	std::unordered_set<std::string> names;
+	for (auto &r : snap.remotes)
+	{
+		names.insert(r.first);
+	}
+	for (auto &r : snap.index->remotes)
+	{
+		names.insert(r.first);
+	}
+	return names;
+}
+
+// re-read every config file into a fresh snapshot
+// config directories are re-indexed and only the remotes already in use
+// are parsed again; on failure the previous snapshot stays current
+int reload_config()
+{
+	std::shared_ptr<const config_snapshot> old = current_remotes();
+	std::unordered_map<std::string, remote_config> parsed;
+	std::shared_ptr<config_index> index = std::make_shared<config_index>();
+	parse_state state(parsed);
+	state.included = &index->included;
+	for (auto &f : config_files)
+	{
+		if (is_directory(f))
+		{
+			index_directory(f, *index);
+			continue;
+		}
+		if (parse_config(state, f.c_str()))
+		{
+			std::cerr<<"Failed to parse config from "<<f<<std::endl;
+			return 1;
+		}
+	}
+
+	std::unordered_set<std::string> in_use;
+	for (auto &r : old->remotes)
+	{
+		if (parsed.find(r.first) == parsed.end())
+		{
+			in_use.insert(r.first);
+		}
+	}
+	if (load_indexed(*index, in_use, parsed))
+	{
+		return 1;
+	}
+
+	publish_config(parsed, index);
+	return 0;
+}
+
+// watch descriptor -> names of config files in that directory
+// an empty name means any file in it (a config directory)
+typedef std::unordered_map<int, std::unordered_set<std::string> > watch_map;
+
+// watch the directory holding path for changes to it, or all of path if
+// it is a directory; watching a directory again just adds to its names
+static int add_watch(int fd, watch_map &watched, const std::string &path)
+{
+	std::string dir, file;
+	if (is_directory(path))
+	{
+		dir = path;
+	}
+	else
+	{
+		split_path(path, dir, file);
+	}
+	int wd = inotify_add_watch(fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_DELETE);
+	if (wd < 0)
+	{
+		std::cerr<<"Failed to watch "<<dir<<": "<<strerror(errno)<<std::endl;
+		return 1;
+	}
+	watched[wd].insert(file);
+	return 0;
+}
+
+// watch every file the current config pulled in with include, wherever
+// it lives; called again after each reload as the includes may change
+static void watch_included(int fd, watch_map &watched)
+{
+	std::shared_ptr<const config_snapshot> snap = current_remotes();
+	for (auto &f : snap->index->included)
+	{
+		add_watch(fd, watched, f);
+	}
+	for (auto &f : snap->index->files)
+	{
+		for (auto &i : f.second.includes)
+		{
+			add_watch(fd, watched, i);
+		}
+	}
+}
+
+// watch the config files and reload in the background whenever one changes
+// the directories are watched since editors tend to replace files wholesale
+int watch_config()
+{
+	int fd = inotify_init1(IN_CLOEXEC);
+	if (fd < 0)
+	{
+		std::cerr<<"Failed to watch config: "<<strerror(errno)<<std::endl;
+		return 1;
+	}
+
+	watch_map watched;
+	for (auto &f : config_files)
+	{
+		if (add_watch(fd, watched, f))
+		{
+			close(fd);
+			return 1;
+		}
+	}
+	watch_included(fd, watched);
+
+	std::thread([fd, watched]() mutable {
+		alignas(struct inotify_event) char buf[4096];
+		while (true)
+		{
+			ssize_t len = read(fd, buf, sizeof(buf));
+			if (len <= 0)
+			{
+				if ((len < 0) && (errno == EINTR)) { continue; }
+				break;
+			}
+			bool changed = false;
+			for (char *p = buf; p < buf + len; )
+			{
+				const struct inotify_event *ev = (const struct inotify_event *)p;
+				auto w = watched.find(ev->wd);
+				if ((ev->len > 0) && (w != watched.end()) &&
+				    ((w->second.count(ev->name) > 0) ||
+				     ((w->second.count("") > 0) && (ev->name[0] != '.'))))
+				{
+					changed = true;
+				}
+				p += sizeof(struct inotify_event) + ev->len;
+			}
+			if (changed)
+			{
+				// let a burst of writes settle before re-reading
+				usleep(100000);
+				reload_config();
+				watch_included(fd, watched);
+			}
+		}
+		close(fd);
+	}).detach();
+	return 0;
+}
+
+// the parts of a SPACE_ENC frame, in the order they are sent
+enum space_enc_part {
+	SPACE_ENC_HEADER,
+	SPACE_ENC_PRE,
+	SPACE_ENC_DATA,
+	SPACE_ENC_POST,
+};
+
+// encode one part of a SPACE_ENC (nec type) frame
+// code and bits are only used for the data part
+int encode_space_enc(const remote_config &remote, space_enc_part part, const char *code, int bits, int pin, gpioPulse_t *irSignal, unsigned int *pulseCount)
+{
+	switch (part)
+	{
+		case SPACE_ENC_HEADER:
+			// insert the header
+			if (irSlingPrepare(irSignal, pulseCount,
+						pin,
+						remote.get("frequency"),
+						double(remote.get("dutycycle"))/100,
+						remote.get("header.on"),
+						remote.get("header.off"),
+						0, 0, 0, 0, 0, nullptr, 0)) // no more content
+			{
+				std::cerr << "Failed to prepare header" <<std::endl;
+				return -1;
+			}
+			break;
+
+		case SPACE_ENC_PRE:
+			// insert the pre-data
+			if (remote.has("pre_data") && remote.has("pre_data_bits"))
+			{
+				int pre_len = (3+remote.get("pre_data_bits"))/4;
+				char pre_data_bits[pre_len+4];
+				snprintf(pre_data_bits,pre_len+3,"0x%0*x",pre_len,remote.get("pre_data"));
+				if (irSlingPrepare(irSignal, pulseCount,
+							pin,
+							remote.get("frequency"),
+							double(remote.get("dutycycle"))/100,
+							0, 0, // no header
+							remote.get("one.on"),
+							remote.get("zero.on"),
+							remote.get("one.off"),
+							remote.get("zero.off"),
+							0, // no trailer yet
+							pre_data_bits,
+							remote.get("pre_data_bits")))
+				{
+					std::cerr << "Failed to prepare pre_data" <<std::endl;
+					return -1;
+				}
+			}
+			break;
+
+		case SPACE_ENC_DATA:
+			// insert the actual data
+			if (irSlingPrepare(irSignal, pulseCount,
+						pin,
+						remote.get("frequency"),
+						double(remote.get("dutycycle"))/100,
+						0, 0, /* no header */
+						remote.get("one.on"),
+						remote.get("zero.on"),
+						remote.get("one.off"),
+						remote.get("zero.off"),
+						0, // no trailer
+						code,
+						bits))
+			{
+				std::cerr << "Failed to prepare signal" <<std::endl;
+				return -1;
+			}
+			break;
+
+		case SPACE_ENC_POST:
+		{
+			// insert any trailer as required
+			// both trailer data and ptrail
+			int post_len = (3+remote.get("post_data_bits"))/4;
+			char post_data_bits[post_len+4];
+			post_data_bits[0] = '\0';
+			if (remote.has("post_data") && (post_len > 0))
+			{
+				snprintf(post_data_bits,post_len+3,"0x%0*x",post_len,remote.get("post_data"));
+			}
+			if (irSlingPrepare(irSignal, pulseCount,
+						pin,
+						remote.get("frequency"),
+						double(remote.get("dutycycle"))/100,
+						0, 0, /* no header */
+						remote.get("one.on"),
+						remote.get("zero.on"),
+						remote.get("one.off"),
+						remote.get("zero.off"),
+						remote.get("ptrail"),
+						post_data_bits,
+						remote.get("post_data_bits")))
+			{
+				std::cerr << "Failed to prepare post_data" <<std::endl;
+				return -1;
+			}
+			break;
+		}
+	}
+	// -1 as well if it no longer fits in the pulse buffer
+	return (*pulseCount > MAX_PULSES) ? -1 : 0;
+}
+
+// encode one press of button on remote into irSignal
+// returns 0 on success, 1 if the button is unknown, -1 if encoding failed
+int encode_button(const remote_config &remote, const std::string &button, int pin, gpioPulse_t *irSignal, unsigned int *pulseCount)
+{
+	if (remote.has_flag("RAW_CODES"))
+	{
+		auto raw = remote.rawcodes.find(button);
+		if (raw == remote.rawcodes.end())
+		{
+			return 1;
+		}
+		if (irSlingPrepareRawPacked(irSignal, pulseCount,
+					pin,
+					remote.get("frequency"),
+					double(remote.get("dutycycle"))/100,
+					remote.rawtimings.data(),
+					remote.rawtimings.size(),
+					(const uint8_t *)raw->second->data(),
+					raw->second->size()))
+		{
+			std::cerr << "Failed to prepare signal" <<std::endl;
+			return -1;
+		}
+		return 0;
+	}
+
+	auto code = remote.codes.find(button);
+	if (code == remote.codes.end())
+	{
+		return 1;
+	}
+
+	// nec type
+	if (remote.has_flag("SPACE_ENC"))
+	{
+		if (encode_space_enc(remote, SPACE_ENC_HEADER, nullptr, 0, pin, irSignal, pulseCount) ||
+		    encode_space_enc(remote, SPACE_ENC_PRE, nullptr, 0, pin, irSignal, pulseCount) ||
+		    encode_space_enc(remote, SPACE_ENC_DATA, code->second.c_str(), remote.get("bits"), pin, irSignal, pulseCount) ||
+		    encode_space_enc(remote, SPACE_ENC_POST, nullptr, 0, pin, irSignal, pulseCount))
+		{
+			return -1;
+		}
+	}
+	else if (remote.has_flag("RC5"))
+	{
+		std::string pattern("0x");
+		if (remote.has("pre_data"))
+		{
+			// TODO support pre_data_bits not modulo 4
+			char xx[50];
+			snprintf(xx,sizeof(xx),"%0*x",(3+remote.get("bits"))/4,remote.get("pre_data"));
+			pattern += xx;
+		}
+		pattern.append(code->second);
+		//std::cout << "pattern is "<<pattern<<std::endl;
+		if (irSlingPrepareRC5(irSignal, pulseCount,
+					pin,
+					remote.get("frequency"),
+					double(remote.get("dutycycle"))/100,
+					remote.get("one.on") + remote.get("one.off"),
+					pattern.c_str(),
+					remote.get("bits") + remote.get("pre_data_bits")))
+		{
+			std::cerr << "Failed to prepare signal" <<std::endl;
+			return -1;
+		}
+	}
+	return 0;
+}
+
+// pigpio waves for the parts of a SPACE_ENC frame that every press of a
+// remote shares, so a press is just a chain of wave IDs
+enum segment {
+	SEGMENT_HEADER,
+	SEGMENT_PRE,
+	SEGMENT_ZERO,
+	SEGMENT_ONE,
+	SEGMENT_POST,
+	SEGMENTS
+};
+struct segment_waves {
+	// the remote they were built from
+	std::shared_ptr<const remote_config> config;
+	// wave ID, or -1 if the segment is empty
+	int wave[SEGMENTS] = { -1, -1, -1, -1, -1 };
+	uint32_t micros[SEGMENTS] = { 0, 0, 0, 0, 0 };
+	unsigned int pulses[SEGMENTS] = { 0, 0, 0, 0, 0 };
+
+	segment_waves() {}
+	segment_waves(const segment_waves &) = delete;
+	segment_waves &operator=(const segment_waves &) = delete;
+	~segment_waves();
+};
+
+void release_segments(segment_waves &segs)
+{
+	for (int s = 0; s < SEGMENTS; ++s)
+	{
+		if (segs.wave[s] >= 0)
+		{
+			irSlingDeleteWave(segs.wave[s]);
+		}
+		segs.wave[s] = -1;
+		segs.micros[s] = 0;
+		segs.pulses[s] = 0;
+	}
+	segs.config = nullptr;
+}
+
+// the waves go when the last press chained from them does
+segment_waves::~segment_waves()
+{
+	release_segments(*this);
+}
+
+// remote name -> its segment waves; only used by the sending thread
+std::unordered_map<std::string, std::shared_ptr<segment_waves> > segments;
+
+// drop the cached presses of a remote, and count the cached presses
+// chained from some segments (defined with the press cache)
+void forget_presses(const std::string &remote);
+size_t cached_chains(const segment_waves *segs);
+
+// make way in the wave budget by dropping the segment waves of the remote
+// holding the highest wave, along with the cached presses chained from
+// them; pigpio only reclaims a deleted wave once every wave above it has
+// gone, so dropping any lower would free nothing
+// returns false if the highest wave cannot go: it is keep's, a press being
+// sent or prepared still holds it, or it is not a segment
+bool evict_segments(const std::string &keep)
+{
+	int top = -1;
+	for (int id = IRSLING_MAX_WAVES - 1; (id >= 0) && (top < 0); --id)
+	{
+		unsigned int pulses, cbs;
+		if (irSlingGetWaveSize(id, &pulses, &cbs) == IRSLING_WAVE_LIVE)
+		{
+			top = id;
+		}
+	}
+	for (auto i = segments.begin(); (top >= 0) && (i != segments.end()); ++i)
+	{
+		if (std::find(std::begin(i->second->wave), std::end(i->second->wave), top) == std::end(i->second->wave))
+		{
+			continue;
+		}
+		if ((i->first == keep) || ((size_t)i->second.use_count() != 1 + cached_chains(i->second.get())))
+		{
+			return false;
+		}
+		std::string name = i->first;
+		segments.erase(i);
+		forget_presses(name);
+		return true;
+	}
+	return false;
+}
+
+// evict segment waves until a plain frame can be sent within the wave
+// budget, whole or in chunks, or there is nothing left to evict
+void make_room(const gpioPulse_t *irSignal, unsigned int pulseCount)
+{
+	while (!irSlingWaveFits(irSignal, pulseCount) && evict_segments(std::string()))
+	{
+	}
+}
+
+// create the segment waves of a remote into segs
+// returns 0, IRSLING_OVER_BUDGET if they do not all fit, or 1 on failure
+int make_segments(segment_waves &segs, const std::string &name, const std::shared_ptr<const remote_config> &remote, int pin)
+{
+	std::vector<gpioPulse_t> irSignal(MAX_PULSES);
+	for (int s = 0; s < SEGMENTS; ++s)
+	{
+		unsigned int pulseCount = 0;
+		int ret = 0;
+		switch (s)
+		{
+			case SEGMENT_HEADER:
+				ret = encode_space_enc(*remote, SPACE_ENC_HEADER, nullptr, 0, pin, irSignal.data(), &pulseCount);
+				break;
+			case SEGMENT_PRE:
+				ret = encode_space_enc(*remote, SPACE_ENC_PRE, nullptr, 0, pin, irSignal.data(), &pulseCount);
+				break;
+			case SEGMENT_ZERO:
+				ret = encode_space_enc(*remote, SPACE_ENC_DATA, "0", 1, pin, irSignal.data(), &pulseCount);
+				break;
+			case SEGMENT_ONE:
+				ret = encode_space_enc(*remote, SPACE_ENC_DATA, "1", 1, pin, irSignal.data(), &pulseCount);
+				break;
+			case SEGMENT_POST:
+				ret = encode_space_enc(*remote, SPACE_ENC_POST, nullptr, 0, pin, irSignal.data(), &pulseCount);
+				break;
+		}
+		if (ret)
+		{
+			return 1;
+		}
+		if (pulseCount == 0)
+		{
+			continue;
+		}
+		int wave = irSlingCreateWave(irSignal.data(), pulseCount);
+		if (wave == IRSLING_OVER_BUDGET)
+		{
+			return IRSLING_OVER_BUDGET;
+		}
+		if (wave < 0)
+		{
+			std::cerr << "Failed to create segment wave for remote " << name << std::endl;
+			return 1;
+		}
+		segs.wave[s] = wave;
+		segs.micros[s] = waveMicros(irSignal.data(), pulseCount);
+		segs.pulses[s] = pulseCount;
+	}
+	segs.config = remote;
+	return 0;
+}
+
+// the segment waves for a remote, created on first use and recreated if
+// a reload changed the remote; nullptr if it cannot be sent as segments
+// or they do not fit in the wave budget
+std::shared_ptr<const segment_waves> remote_segments(const std::string &name, const std::shared_ptr<const remote_config> &remote, int pin)
+{
+	if (!remote->has_flag("SPACE_ENC") || remote->has_flag("RAW_CODES"))
+	{
+		return nullptr;
+	}
+	auto found = segments.find(name);
+	if (found != segments.end())
+	{
+		if (found->second->config == remote)
+		{
+			return found->second;
+		}
+		// presses still holding the old waves keep them until they finish
+		segments.erase(found);
+	}
+
+	std::shared_ptr<segment_waves> segs = std::make_shared<segment_waves>();
+	int ret;
+	// the segments made so far are the highest waves, so releasing them
+	// really frees them before making way for another try
+	while ((ret = make_segments(*segs, name, remote, pin)) == IRSLING_OVER_BUDGET)
+	{
+		release_segments(*segs);
+		if (!evict_segments(name))
+		{
+			std::cerr << "Wave budget exhausted, sending remote " << name << " without segments" << std::endl;
+			return nullptr;
+		}
+	}
+	if (ret)
+	{
+		return nullptr;
+	}
+	segments[name] = segs;
+	return segs;
+}
+
+// build the wave chain for one press from a remote's segments
+// returns as encode_button, or -1 if the press does not fit in a chain
+int chain_button(const segment_waves &segs, const std::string &button, std::vector<char> &chain, uint32_t &micros)
+{
+	const remote_config &remote(*segs.config);
+	auto code = remote.codes.find(button);
+	if (code == remote.codes.end())
+	{
+		return 1;
+	}
+
+	chain.clear();
+	micros = 0;
+	auto add = [&](int s) {
+		if (segs.wave[s] >= 0)
+		{
+			chain.push_back((char)segs.wave[s]);
+			micros += segs.micros[s];
+		}
+	};
+
+	add(SEGMENT_HEADER);
+	add(SEGMENT_PRE);
+	int bits = remote.get("bits");
+	for (int i = 0; i < bits; ++i)
+	{
+		switch (getbit(code->second.c_str(), i, bits))
+		{
+			case 0:
+				add(SEGMENT_ZERO);
+				break;
+			case 1:
+				add(SEGMENT_ONE);
+				break;
+		}
+	}
+	add(SEGMENT_POST);
+
+	if (chain.size() > MAX_CHAIN)
+	{
+		chain.clear();
+		return -1;
+	}
+	return 0;
+}
+
+// a button press rendered to a pulse train rather than sent
+struct rendered_press {
+	std::string remote;
+	std::string button;
+	// as encode_button
+	int result = 0;
+	// gap to leave after the press
+	int gap = 0;
+	std::vector<gpioPulse_t> pulses;
+	// the remote as it was when the press was encoded
+	std::shared_ptr<const remote_config> config;
+	// when sent as segment waves, the chain of wave IDs and its length,
+	// and the segments, which are kept while the press is
+	std::vector<char> chain;
+	uint32_t chainMicros = 0;
+	std::shared_ptr<const segment_waves> segs;
+};
+
+// trace file for one press when rendering into a directory
+std::string trace_filename(const std::string &dir, const rendered_press &press, bool vcd)
+{
+	std::string name = press.remote + "." + press.button;
+	std::replace(name.begin(), name.end(), '/', '_');
+	return dir + "/" + name + (vcd ? ".vcd" : ".irsl");
+}
+
+// write the presses to one trace file, one after another
+int write_trace(const std::string &path, bool vcd, int pin, const rendered_press *presses, size_t count)
+{
+	FILE *out = fopen(path.c_str(), "wb");
+	if (out == nullptr)
+	{
+		std::cerr<<"Failed to create "<<path<<": "<<strerror(errno)<<std::endl;
+		return 1;
+	}
+	int ret = vcd ? irSlingWriteVCDHeader(out, 1u << pin) : irSlingWriteTraceHeader(out);
+	uint64_t now = 0;
+	for (size_t i = 0; (i < count) && (ret == 0); ++i)
+	{
+		const rendered_press &press = presses[i];
+		if (press.result != 0)
+		{
+			continue;
+		}
+		std::string name = press.remote + "." + press.button;
+		if (vcd)
+		{
+			ret = irSlingWriteVCD(out, 1u << pin, name.c_str(), press.pulses.data(), press.pulses.size(), now, &now);
+			now += press.gap;
+		}
+		else
+		{
+			ret = irSlingWriteTrace(out, name.c_str(), press.pulses.data(), press.pulses.size());
+		}
+	}
+	if (fclose(out) != 0)
+	{
+		ret = 1;
+	}
+	if (ret)
+	{
+		std::cerr<<"Failed to write "<<path<<std::endl;
+	}
+	return ret;
+}
+
+// run the full encoding for each press across all cores and write the
+// pulse trains to output: a single trace file, or one file per press if
+// output is a directory
+int render_presses(std::vector<rendered_press> &presses, int pin, const std::string &output, bool vcd)
+{
+	bool per_press = is_directory(output);
+	std::atomic<int> failed(0);
+
+	run_parallel(presses.size(), [&](size_t i) {
+		// one pulse buffer per thread, reused for every press it encodes
+		static thread_local std::vector<gpioPulse_t> irSignal(MAX_PULSES);
+		rendered_press &press = presses[i];
+		std::shared_ptr<const remote_config> remote = find_remote(press.remote);
+		unsigned int pulseCount = 0;
+		irSlingSetProbeContext(press.remote.c_str(), press.button.c_str());
+		press.result = encode_button(*remote, press.button, pin, irSignal.data(), &pulseCount);
+		if (press.result > 0)
+		{
+			std::cerr << "Button \"" << press.button << "\" is unknown on remote " << press.remote << std::endl;
+		}
+		else if (press.result < 0)
+		{
+			std::cerr << "Failed to encode " << press.remote << "." << press.button << std::endl;
+		}
+		press.gap = remote->get("gap");
+		if (press.result == 0)
+		{
+			press.pulses.assign(irSignal.begin(), irSignal.begin() + pulseCount);
+		}
+		if (per_press && (press.result == 0))
+		{
+			failed |= write_trace(trace_filename(output, press, vcd), vcd, pin, &press, 1);
+			press.pulses.clear();
+			press.pulses.shrink_to_fit();
+		}
+	});
+
+	if (!per_press)
+	{
+		failed |= write_trace(output, vcd, pin, presses.data(), presses.size());
+	}
+	return failed;
+}
+
+// touch enough stack that the transmit path never faults in a new page
+static void __attribute__((noinline)) prefault_stack()
+{
+	volatile char stack[256 * 1024];
+	memset((char *)stack, 0, sizeof(stack));
+}
+
+// lock and pre-fault all memory, then run this thread under SCHED_FIFO at
+// priority, pinned to cpu unless that is negative
+int enter_realtime(int priority, int cpu)
+{
+	// keep freed memory rather than handing it back, so it stays locked
+	mallopt(M_TRIM_THRESHOLD, -1);
+	mallopt(M_MMAP_MAX, 0);
+	if (mlockall(MCL_CURRENT | MCL_FUTURE))
+	{
+		std::cerr<<"Failed to lock memory: "<<strerror(errno)<<std::endl;
+		return 1;
+	}
+	prefault_stack();
+
+	struct sched_param param;
+	memset(&param, 0, sizeof(param));
+	param.sched_priority = priority;
+	if (sched_setscheduler(0, SCHED_FIFO, &param))
+	{
+		std::cerr<<"Failed to set SCHED_FIFO priority "<<priority<<": "<<strerror(errno)<<std::endl;
+		return 1;
+	}
+
+	if (cpu >= 0)
+	{
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+		CPU_SET(cpu, &cpus);
+		if (sched_setaffinity(0, sizeof(cpus), &cpus))
+		{
+			std::cerr<<"Failed to pin to cpu "<<cpu<<": "<<strerror(errno)<<std::endl;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// split remote.button, falling back to defaultremote
+void split_button(const char *arg, const std::string &defaultremote, std::string &remote, std::string &button)
+{
+	const char * dot = strchr(arg,'.');
+	if (dot == nullptr)
+	{
+		// no remote mentioned
+		remote = defaultremote;
+		button = arg;
+	}
+	else
+	{
+		remote = std::string(arg,dot - arg);
+		button = dot+1;
+	}
+}
+
+// how presses are sent
+struct send_options {
+	int pin = 23;
+	// verify on this loopback pin if not negative
+	int verifypin = -1;
+	int tolerance = 10;
+	int retries = 0;
+	// send SPACE_ENC remotes as segment chains
+	bool segmented = false;
+	// start the next frame at this time (see -T), cleared once used
+	std::string schedule;
+	struct timespec deadline;
+};
+
+// when the next press may start, so gaps hold between presses
+struct pacing {
+	bool pending = false;
+	struct timespec next;
+};
+
+static void sleep_until(const struct timespec &when)
+{
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &when, nullptr) == EINTR)
+	{
+	}
+}
+
+static struct timespec after_us(int us)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	t.tv_sec += us / 1000000;
+	t.tv_nsec += (long)(us % 1000000) * 1000;
+	if (t.tv_nsec >= 1000000000)
+	{
+		t.tv_sec++;
+		t.tv_nsec -= 1000000000;
+	}
+	return t;
+}
+
+// heap held by an encoded press
+size_t press_bytes(const rendered_press &press)
+{
+	return sizeof(press) + press.remote.capacity() + press.button.capacity() +
+	       press.pulses.capacity() * sizeof(gpioPulse_t) + press.chain.capacity();
+}
+
+// encoded presses kept across presses: "remote.button" -> press
+// an entry is only used while its remote is still the current config
+struct cached_press {
+	std::shared_ptr<const rendered_press> press;
+	// last use, for evicting the least recently used
+	unsigned long used;
+};
+std::mutex press_cache_lock;
+std::unordered_map<std::string, cached_press> press_cache;
+unsigned long press_cache_used = 0;
+size_t press_cache_bytes = 0;
+// most heap the cache may hold, 0 for no limit (see -M)
+size_t press_cache_limit = 0;
+
+// cache press under key, evicting the least recently used presses to keep
+// within the limit; a press bigger than the whole limit is not kept
+void cache_press(const std::string &key, const std::shared_ptr<const rendered_press> &press)
+{
+	std::lock_guard<std::mutex> lock(press_cache_lock);
+	auto old = press_cache.find(key);
+	if (old != press_cache.end())
+	{
+		press_cache_bytes -= press_bytes(*old->second.press);
+		press_cache.erase(old);
+	}
+	size_t bytes = press_bytes(*press);
+	if ((press_cache_limit > 0) && (bytes > press_cache_limit))
+	{
+		return;
+	}
+	while ((press_cache_limit > 0) && (press_cache_bytes + bytes > press_cache_limit))
+	{
+		auto oldest = press_cache.begin();
+		for (auto i = press_cache.begin(); i != press_cache.end(); ++i)
+		{
+			if (i->second.used < oldest->second.used)
+			{
+				oldest = i;
+			}
+		}
+		press_cache_bytes -= press_bytes(*oldest->second.press);
+		press_cache.erase(oldest);
+	}
+	press_cache[key] = cached_press{ press, ++press_cache_used };
+	press_cache_bytes += bytes;
+}
+
+void forget_presses(const std::string &remote)
+{
+	std::lock_guard<std::mutex> lock(press_cache_lock);
+	for (auto i = press_cache.begin(); i != press_cache.end(); )
+	{
+		if (i->second.press->remote == remote)
+		{
+			press_cache_bytes -= press_bytes(*i->second.press);
+			i = press_cache.erase(i);
+		}
+		else
+		{
+			++i;
+		}
+	}
+}
+
+size_t cached_chains(const segment_waves *segs)
+{
+	std::lock_guard<std::mutex> lock(press_cache_lock);
+	size_t count = 0;
+	for (auto &c : press_cache)
+	{
+		count += (c.second.press->segs.get() == segs) ? 1 : 0;
+	}
+	return count;
+}
+
+// delete every wave still held, which must happen before pigpio is shut
+// down: the segment waves, and the cached presses chained from them
+void release_all_waves()
+{
+	{
+		std::lock_guard<std::mutex> lock(press_cache_lock);
+		press_cache.clear();
+		press_cache_bytes = 0;
+	}
+	segments.clear();
+}
+
+// encode a press of button on config, as a chain of segs if given
+std::shared_ptr<rendered_press> encode_press(const std::string &remote, const std::string &button, const std::shared_ptr<const remote_config> &config, const std::shared_ptr<const segment_waves> &segs, int pin)
+{
+	std::shared_ptr<rendered_press> press = std::make_shared<rendered_press>();
+	press->remote = remote;
+	press->button = button;
+	press->config = config;
+	press->gap = config->get("gap");
+	irSlingSetProbeContext(press->remote.c_str(), press->button.c_str());
+
+	if (segs != nullptr)
+	{
+		press->result = chain_button(*segs, button, press->chain, press->chainMicros);
+		if (press->result >= 0)
+		{
+			press->segs = segs;
+			return press;
+		}
+	}
+	std::vector<gpioPulse_t> irSignal(MAX_PULSES);
+	unsigned int pulseCount = 0;
+	press->result = encode_button(*config, button, pin, irSignal.data(), &pulseCount);
+	if (press->result == 0)
+	{
+		press->pulses.assign(irSignal.begin(), irSignal.begin() + pulseCount);
+	}
+	return press;
+}
+
+// look up and encode a press of button on remote, as segment chains where
+// enabled; encoded presses are reused until a reload changes the remote
+// returns nullptr if there is no such remote
+std::shared_ptr<const rendered_press> lookup_press(const std::string &remote, const std::string &button, const send_options &opts)
+{
+	std::shared_ptr<const remote_config> config = find_remote(remote);
+	if (config == nullptr)
+	{
+		return nullptr;
+	}
+
+	std::string key = remote + "." + button;
+	bool stale = false;
+	{
+		std::lock_guard<std::mutex> lock(press_cache_lock);
+		auto cached = press_cache.find(key);
+		if ((cached != press_cache.end()) && (cached->second.press->config == config))
+		{
+			cached->second.used = ++press_cache_used;
+			return cached->second.press;
+		}
+		stale = (cached != press_cache.end());
+	}
+	if (stale)
+	{
+		// the remote was reloaded: none of its cached presses are any use
+		// now, and dropping them lets go of the waves they were chained from
+		forget_presses(remote);
+	}
+
+	std::shared_ptr<const segment_waves> segs;
+	if (opts.segmented)
+	{
+		segs = remote_segments(remote, config, opts.pin);
+	}
+	std::shared_ptr<const rendered_press> press = encode_press(remote, button, config, segs, opts.pin);
+	cache_press(key, press);
+	return press;
+}
+
+// every button of a remote, sorted
+std::vector<std::string> remote_buttons(const remote_config &remote)
+{
+	std::vector<std::string> buttons;
+	for (auto &b : remote.codes)
+	{
+		buttons.push_back(b.first);
+	}
+	for (auto &b : remote.rawcodes)
+	{
+		buttons.push_back(b.first);
+	}
+	std::sort(buttons.begin(), buttons.end());
+	return buttons;
+}
+
+// split a comma separated list of hot presses into remote, button pairs
+// "all" is every remote, an entry naming a remote is all of its buttons
+// (an empty button), anything else is a button as on the command line
+std::vector<std::pair<std::string, std::string> > split_hot(const std::string &hot, const std::string &defaultremote, const std::unordered_set<std::string> &known)
+{
+	std::vector<std::pair<std::string, std::string> > out;
+	std::vector<std::string> items;
+	tokenise(hot, ", ", items);
+	for (auto &item : items)
+	{
+		if (item == "all")
+		{
+			for (auto &r : known)
+			{
+				out.push_back(std::make_pair(r, std::string()));
+			}
+		}
+		else if ((item.find('.') == std::string::npos) && (known.count(item) > 0))
+		{
+			out.push_back(std::make_pair(item, std::string()));
+		}
+		else
+		{
+			std::string remote, button;
+			split_button(item.c_str(), defaultremote, remote, button);
+			out.push_back(std::make_pair(remote, button));
+		}
+	}
+	return out;
+}
+
+// encode the hot presses across all cores into the press cache, so that
+// the first press of each costs no more than a repeat
+// segment waves are created up front here since pigpio is not thread safe
+void prewarm_presses(const std::vector<std::pair<std::string, std::string> > &hot, const send_options &opts)
+{
+	auto started = std::chrono::steady_clock::now();
+
+	struct job {
+		std::string remote;
+		std::string button;
+		std::shared_ptr<const remote_config> config;
+		std::shared_ptr<const segment_waves> segs;
+	};
+	std::vector<job> jobs;
+	std::unordered_set<std::string> seen;
+	for (auto &h : hot)
+	{
+		std::shared_ptr<const remote_config> config = find_remote(h.first);
+		if (config == nullptr)
+		{
+			std::cerr << "Remote " << h.first << " does not exist" << std::endl;
+			continue;
+		}
+		std::shared_ptr<const segment_waves> segs;
+		if (opts.segmented)
+		{
+			segs = remote_segments(h.first, config, opts.pin);
+		}
+		std::vector<std::string> buttons;
+		if (h.second.size() > 0)
+		{
+			buttons.push_back(h.second);
+		}
+		else
+		{
+			buttons = remote_buttons(*config);
+		}
+		for (auto &b : buttons)
+		{
+			if (seen.insert(h.first + "." + b).second)
+			{
+				jobs.push_back(job{ h.first, b, config, segs });
+			}
+		}
+	}
+
+	unsigned int threads = run_parallel(jobs.size(), [&](size_t i) {
+		const job &j = jobs[i];
+		std::shared_ptr<rendered_press> press = encode_press(j.remote, j.button, j.config, j.segs, opts.pin);
+		if (press->result > 0)
+		{
+			std::cerr << "Button \"" << j.button << "\" is unknown on remote " << j.remote << std::endl;
+			return;
+		}
+		cache_press(j.remote + "." + j.button, press);
+	});
+
+	// what the cache holds, as -M may have evicted or refused some
+	size_t cached, bytes;
+	{
+		std::lock_guard<std::mutex> lock(press_cache_lock);
+		cached = press_cache.size();
+		bytes = press_cache_bytes;
+	}
+	auto took = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - started);
+	std::cerr << "prewarmed " << jobs.size() << " presses on " << threads << " threads in "
+	          << took.count() / 1000.0 << "ms, cache holds " << cached << " presses, "
+	          << (bytes + 1023) / 1024 << "KiB" << std::endl;
+}
+
+// edges captured for -l, static so that verifying allocates nothing and
+// the buffer is locked with the rest of memory under -P
+irSlingCapture_t loopback_capture;
+
+// send an encoded press, then repeats more frames of it
+// waits first for the gap after the previous press
+// returns 0, or with 1 set if a frame failed to send and 2 if
+// verification failed
+int send_press(const rendered_press &press, int repeats, send_options &opts, pacing &pace)
+{
+	const remote_config &remote(*press.config);
+	gpioPulse_t *irSignal = const_cast<gpioPulse_t *>(press.pulses.data());
+	unsigned int pulseCount = press.pulses.size();
+	int result = 0;
+
+	irSlingSetProbeContext(press.remote.c_str(), press.button.c_str());
+	if (pace.pending)
+	{
+		IRSLING_PROBE(gap__start, pulseCount, 0);
+		sleep_until(pace.next);
+		IRSLING_PROBE(gap__done, pulseCount, 0);
+	}
+
+	int gap = remote.get("gap");
+	if (remote.has("repeat_gap"))
+	{
+		gap = remote.get("repeat_gap");
+	}
+
+	for(int i=0 ; i<=repeats; ++i)
+	{
+		if (press.chain.size() == 0)
+		{
+			make_room(irSignal, pulseCount);
+		}
+		if (opts.schedule.size() > 0)
+		{
+			// only the first frame is scheduled, the rest follow on
+			if (opts.schedule[0] != '@')
+			{
+				// ticks only reach so far ahead, so sleep until the
+				// deadline is close before converting it to one
+				struct timespec close = opts.deadline;
+				close.tv_sec -= 1;
+				sleep_until(close);
+			}
+			uint32_t startTick = (opts.schedule[0] == '@') ? std::stoul(opts.schedule.substr(1), nullptr, 0) : irSlingTickAt(&opts.deadline);
+			opts.schedule.clear();
+			uint32_t actualStart = 0;
+			int ret;
+			if (press.chain.size() > 0)
+			{
+				ret = transmitWaveChainAt(const_cast<char *>(press.chain.data()), press.chain.size(), press.chainMicros, startTick, opts.pin, &actualStart);
+			}
+			else
+			{
+				ret = transmitWaveAt(irSignal, pulseCount, startTick, opts.pin, &actualStart);
+			}
+			if (ret == 0)
+			{
+				std::cout << "start " << press.remote << "." << press.button << " tick " << actualStart
+				          << " late " << (int32_t)(actualStart - startTick) << "us" << std::endl;
+			}
+			else if (ret == 2)
+			{
+				std::cout << "start " << press.remote << "." << press.button << " due at tick " << startTick
+				          << " not measured, no edge seen" << std::endl;
+			}
+			else
+			{
+				std::cerr << "Failed to send " << press.remote << "." << press.button << std::endl;
+				result |= 1;
+			}
+		}
+		else if (press.chain.size() > 0)
+		{
+			if (transmitWaveChain(const_cast<char *>(press.chain.data()), press.chain.size(), press.chainMicros))
+			{
+				result |= 1;
+			}
+		}
+		else if (opts.verifypin < 0)
+		{
+			if (transmitWave(irSignal, pulseCount))
+			{
+				result |= 1;
+			}
+		}
+		else
+		{
+			irSlingVerifyResult_t verified;
+			int ret = transmitWaveVerifiedInto(irSignal, pulseCount, opts.pin, opts.verifypin, opts.tolerance, opts.retries, &loopback_capture, &verified);
+			if (ret == 1)
+			{
+				std::cerr << "Failed to send " << press.remote << "." << press.button << std::endl;
+			}
+			else
+			{
+				std::cout << "verify " << press.remote << "." << press.button
+				          << ": edges " << verified.capturedEdges << "/" << verified.expectedEdges
+				          << " dropped " << verified.droppedEdges
+				          << " jitter " << verified.jitter << "us"
+				          << " max " << verified.maxError << "us"
+				          << " drift " << verified.drift << "us"
+				          << (verified.withinTolerance ? " ok" : " OUT OF TOLERANCE") << std::endl;
+			}
+			if (ret)
+			{
+				result |= (ret == 1) ? 1 : 2;
+			}
+		}
+		// only delay if repeating this press
+		if (i < repeats)
+		{
+			IRSLING_PROBE(gap__start, pulseCount, gap);
+			usleep(gap);
+			IRSLING_PROBE(gap__done, pulseCount, gap);
+		}
+	}
+
+	// the next press waits for the remote's gap
+	pace.pending = true;
+	pace.next = after_us(remote.get("gap"));
+	return result;
+}
+
+// the memory and wave budget in use: the heap of each remote and of the
+// press cache, and the pulses and control blocks of each wave held
+void report_budget(std::ostream &out)
+{
+	std::shared_ptr<const config_snapshot> snap = current_remotes();
+	size_t total = 0;
+	for (auto &r : snap->remotes)
+	{
+		size_t bytes = r.second->heap_bytes();
+		out << "remote " << r.first << " heap " << bytes << std::endl;
+		total += bytes;
+	}
+	out << "remotes " << snap->remotes.size() << " heap " << total << std::endl;
+	{
+		std::lock_guard<std::mutex> lock(press_cache_lock);
+		out << "presses " << press_cache.size() << " heap " << press_cache_bytes << " limit " << press_cache_limit << std::endl;
+	}
+	// every wave pigpio holds, labelled with the current segment it is;
+	// other live ones belong to presses still holding an older remote's
+	// segments, and deleted ones wait for the waves above them to go
+	static const char *segment_names[SEGMENTS] = { "header", "pre", "zero", "one", "post" };
+	std::unordered_map<int, std::string> labels;
+	for (auto &s : segments)
+	{
+		for (int w = 0; w < SEGMENTS; ++w)
+		{
+			labels[s.second->wave[w]] = s.first + "." + segment_names[w];
+		}
+	}
+	for (int id = 0; id < IRSLING_MAX_WAVES; ++id)
+	{
+		unsigned int pulses, cbs;
+		int state = irSlingGetWaveSize(id, &pulses, &cbs);
+		if (state == IRSLING_WAVE_FREE)
+		{
+			continue;
+		}
+		auto label = labels.find(id);
+		out << "wave " << id << " pulses " << pulses << " cbs " << cbs << " "
+		    << ((state == IRSLING_WAVE_DELETED) ? "deleted" : (label != labels.end()) ? label->second : "retired") << std::endl;
+	}
+	irSlingWaveUsage_t usage;
+	irSlingGetWaveUsage(&usage);
+	out << "waves " << usage.waves << " pulses " << usage.pulses << "/" << usage.maxPulses
+	    << " cbs " << usage.cbs << "/" << usage.maxCbs << " deleted " << usage.deleted
+	    << " chunked " << usage.chunked << std::endl;
+}
+
+// send "remote.button [repeats]" lines read from source ("-" for stdin)
+// as they arrive, acknowledging each on stdout once it has been sent
+// config, pigpio and encoded presses all stay warm between lines; a fifo
+// is reopened whenever its writer closes it
+int run_batch(const std::string &source, const std::string &defaultremote, send_options &opts)
+{
+	int result = 0;
+	pacing pace;
+	struct stat st;
+	bool fifo = (source != "-") && (stat(source.c_str(), &st) == 0) && S_ISFIFO(st.st_mode);
+	do
+	{
+		std::ifstream file;
+		std::istream *in = &std::cin;
+		if (source != "-")
+		{
+			file.open(source);
+			if (!file.is_open())
+			{
+				std::cerr<<"Failed to open "<<source<<": "<<strerror(errno)<<std::endl;
+				return 1;
+			}
+			in = &file;
+		}
+
+		std::string line;
+		while (std::getline(*in, line))
+		{
+			std::vector<std::string> tokens;
+			tokenise(line, space_delimiters, tokens);
+			if (tokens.empty() || (tokens[0].at(0) == '#'))
+			{
+				continue;
+			}
+			if (tokens[0] == "budget")
+			{
+				report_budget(std::cout);
+				std::cout << "ok budget" << std::endl;
+				continue;
+			}
+			std::string remote, button;
+			split_button(tokens[0].c_str(), defaultremote, remote, button);
+			std::shared_ptr<const rendered_press> press = lookup_press(remote, button, opts);
+			if (press == nullptr)
+			{
+				std::cout << "error " << tokens[0] << " unknown remote" << std::endl;
+				result |= 1;
+				continue;
+			}
+			if (press->result != 0)
+			{
+				std::cout << "error " << tokens[0] << ((press->result > 0) ? " unknown button" : " encoding failed") << std::endl;
+				result |= 1;
+				continue;
+			}
+			int repeats = press->config->get("min_repeat");
+			if ((tokens.size() > 1) && (tokens[1].at(0) != '#'))
+			{
+				repeats = std::atoi(tokens[1].c_str());
+			}
+			int sent = send_press(*press, repeats, opts, pace);
+			if (sent)
+			{
+				std::cout << "error " << tokens[0] << ((sent & 1) ? " send failed" : " verify failed") << std::endl;
+				result |= sent;
+				continue;
+			}
+			std::cout << "ok " << tokens[0] << std::endl;
+		}
+	}
+	while (fifo);
+	return result;
+}
+
+// -p pin
+// -f config file or directory of config files (loaded on demand)
+// -e exact (drift-free) carrier synthesis
+// -w watch config files and reload on change
+// -o render to a trace file (or directory) instead of transmitting
+// -F trace format, bin or vcd
+// -a render every button of every remote
+// -l verify sent frames on a looped back input pin
+// -t verify tolerance (us)
+// -R retransmit frames out of tolerance up to this many times
+// -P real time: lock memory and send under SCHED_FIFO at this priority
+// -C pin the real time sending thread to this cpu
+// -s send SPACE_ENC remotes as chains of shared header/bit/trailer waves
+// -T start the first frame at a CLOCK_MONOTONIC time (us), +us from now or @gpiotick
+// -i read remote.button [repeats] lines from stdin (-) or a fifo and send them
+// -H prewarm: encode all, or these remotes / remote.buttons, before sending
+// -B limit the pulses[,control blocks] held by waves
+// -M limit the heap (KiB) held by encoded presses
+// * button name(s)
+int main(int argc, char *argv[])
+{
+	int pin = 23;
+	int c ;
+	bool dumpconfig=false;
+	bool watch=false;
+	std::string output;
+	std::string format;
+	bool vcd=false;
+	bool allbuttons=false;
+	int verifypin = -1;
+	int tolerance = 10;
+	int retries = 0;
+	int priority = 0;
+	int cpu = -1;
+	bool segmented = false;
+	std::string schedule;
+	struct timespec deadline = { 0, 0 };
+	std::string batch;
+	std::string hot;
+	std::string thisremote;
+	std::string defaultremote;
+	while( ( c = getopt (argc, argv, "r:dep:f:wo:F:al:t:R:P:C:sT:i:H:B:M:") ) != -1 ) 
+	{
+		switch(c)
+		{
+			case 'd':
+				dumpconfig = true;
+				break;
+			case 'e':
+				irSlingSetCarrierMode(IRSLING_CARRIER_EXACT);
+				break;
+			case 'f':
+				config_files.push_back(optarg);
+				break;
+			case 'p':
+				if(optarg) pin = std::atoi(optarg) ;
+				break;
+			case 'r':
+				if(optarg) defaultremote = optarg;
+				break;
+			case 'w':
+				watch = true;
+				break;
+			case 'o':
+				output = optarg;
+				break;
+			case 'F':
+				format = optarg;
+				break;
+			case 'a':
+				allbuttons = true;
+				break;
+			case 'l':
+				if(optarg) verifypin = std::atoi(optarg) ;
+				break;
+			case 't':
+				if(optarg) tolerance = std::atoi(optarg) ;
+				break;
+			case 'R':
+				if(optarg) retries = std::atoi(optarg) ;
+				break;
+			case 'P':
+				if(optarg) priority = std::atoi(optarg) ;
+				break;
+			case 'C':
+				if(optarg) cpu = std::atoi(optarg) ;
+				break;
+			case 'B':
+			{
+				// pulses[,control blocks]
+				const char *cbs = strchr(optarg, ',');
+				irSlingSetWaveBudget(std::atoi(optarg), cbs ? std::atoi(cbs + 1) : 0);
+				break;
+			}
+			case 'M':
+				press_cache_limit = (size_t)std::atol(optarg) * 1024;
+				break;
+			case 's':
+				segmented = true;
+				break;
+			case 'i':
+				batch = optarg;
+				break;
+			case 'H':
+				hot = optarg;
+				break;
+			case 'T':
+				schedule = optarg;
+				try
 				{
-					int pre_len = (3+remote.config["pre_data_bits"])/4;
-					char pre_data_bits[pre_len+4];
-					snprintf(pre_data_bits,pre_len+3,"0x%0*x",pre_len,remote.config["pre_data"]);
-					if (irSlingPrepare(irSignal, &pulseCount,
-								pin,
-								remote.config["frequency"],
-								double(remote.config["dutycycle"])/100,
-								0, 0, // no header
-								remote.config["one.on"],
-								remote.config["zero.on"],
-								remote.config["one.off"],
-								remote.config["zero.off"],
-								0, // no trailer yet
-								pre_data_bits,
-								remote.config["pre_data_bits"]))
+					if (schedule[0] == '@')
 					{
-						std::cerr << "Failed to prepare pre_data" <<std::endl;
-						continue;
+						std::stoul(schedule.substr(1), nullptr, 0);
+						break;
 					}
+					// CLOCK_MONOTONIC microseconds, or +microseconds from now
+					unsigned long long us = std::stoull(schedule[0] == '+' ? schedule.substr(1) : schedule);
+					if (schedule[0] == '+')
+					{
+						clock_gettime(CLOCK_MONOTONIC, &deadline);
+						us += (unsigned long long)deadline.tv_sec * 1000000 + deadline.tv_nsec / 1000;
+					}
+					deadline.tv_sec = us / 1000000;
+					deadline.tv_nsec = (us % 1000000) * 1000;
 				}
-				// insert the actual data
-				if (irSlingPrepare(irSignal, &pulseCount,
-							pin,
-							remote.config["frequency"],
-							double(remote.config["dutycycle"])/100,
-							0, 0, /* no header */
-							remote.config["one.on"],
-							remote.config["zero.on"],
-							remote.config["one.off"],
-							remote.config["zero.off"],
-							0, // no trailer
-							code->second.c_str(),
-							remote.config["bits"]))
-				{
-					std::cerr << "Failed to prepare signal" <<std::endl;
-					continue;
-				}
-				// insert any trailer as required
-				// both trailer data and ptrail
-				int post_len = (3+remote.config["post_data_bits"])/4;
-				char post_data_bits[post_len+4];
-				if ((remote.config.find("post_data") != remote.config.end()) && (post_len > 0))
-				{
-					snprintf(post_data_bits,post_len+3,"0x%0*x",post_len,remote.config["post_data"]);
-				}
-				if (irSlingPrepare(irSignal, &pulseCount,
-							pin,
-							remote.config["frequency"],
-							double(remote.config["dutycycle"])/100,
-							0, 0, /* no header */
-							remote.config["one.on"],
-							remote.config["zero.on"],
-							remote.config["one.off"],
-							remote.config["zero.off"],
-							remote.config["ptrail"],
-							post_data_bits,
-							remote.config["post_data_bits"]))
+				catch (...)
 				{
-					std::cerr << "Failed to prepare post_data" <<std::endl;
-					continue;
+					std::cerr<<"Bad start time "<<schedule<<std::endl;
+					exit(1);
 				}
+				break;
+			default:
+				std::cerr<<"Unexpected argument "<<c<<std::endl
+				         <<"Valid arguments are:"<<std::endl
+					 <<"    -p pinnumber"<<std::endl
+					 <<"    -f lircremotefile or directory"<<std::endl
+					 <<"    -r defaultremotename"<<std::endl
+					 <<"    -d = dumpconfig"<<std::endl
+					 <<"    -e = exact carrier frequency"<<std::endl
+					 <<"    -w = reload config files when they change"<<std::endl
+					 <<"    -o tracefile or directory = render instead of sending"<<std::endl
+					 <<"    -F bin|vcd = trace format"<<std::endl
+					 <<"    -a = render every button of every remote"<<std::endl
+					 <<"    -l loopbackpin = verify timing of what was sent"<<std::endl
+					 <<"    -t tolerance = verify tolerance in us (default 10)"<<std::endl
+					 <<"    -R retries = resend frames out of tolerance"<<std::endl
+					 <<"    -P priority = send with SCHED_FIFO priority, memory locked"<<std::endl
+					 <<"    -C cpu = pin the sending thread to cpu (with -P)"<<std::endl
+					 <<"    -s = send as chains of shared segment waves"<<std::endl
+					 <<"    -T [+]us|@tick = start the first frame at a CLOCK_MONOTONIC"<<std::endl
+					 <<"       time, that long from now, or at a gpioTick()"<<std::endl
+					 <<"    -i -|fifo = send remote.button [repeats] lines as they are read"<<std::endl
+					 <<"    -H hot = encode these presses up front: all, remote or"<<std::endl
+					 <<"       remote.button, comma separated (all with -P and -i)"<<std::endl
+					 <<"    -B pulses[,cbs] = wave budget, frames that do not fit are"<<std::endl
+					 <<"       sent in chunks and segment waves evicted"<<std::endl
+					 <<"    -M KiB = most heap to keep encoded presses in"<<std::endl
+					 <<"     button button button... or"<<std::endl
+					 <<"     remotename.button remotename.button..."<<std::endl;
+				exit(1);
+		}			    
+	}
+	// an explicit -F wins, otherwise go by the output's extension
+	if (format.empty())
+	{
+		vcd = (output.size() > 4) && (output.compare(output.size() - 4, 4, ".vcd") == 0);
+	}
+	else if ((format == "vcd") || (format == "bin"))
+	{
+		vcd = (format == "vcd");
+	}
+	else
+	{
+		std::cerr << "Unknown trace format " << format << std::endl;
+		exit(1);
+	}
+	// verification needs the whole frame as one wave
+	if (verifypin >= 0)
+	{
+		segmented = false;
+	}
+	if (reload_config())
+	{
+		exit(1);
+	}
+	if (watch && watch_config())
+	{
+		exit(1);
+	}
+
+	std::unordered_set<std::string> known = remote_names(*current_remotes());
+	if (known.size() == 0)
+	{
+		std::cerr<<"No remotes defined!" << std::endl;
+		exit(1);
+	}
+
+	// if only one remote defined then use that
+	if ((known.size() == 1) && (thisremote.size() == 0))
+	{
+		defaultremote = *known.begin();
+	}
+
+	// parse only the remotes that are going to be used
+	std::unordered_set<std::string> wanted;
+	if (dumpconfig || allbuttons)
+	{
+		wanted = known;
+	}
+	for (c=optind ; c < argc ; ++c)
+	{
+		std::string button;
+		split_button(argv[c], defaultremote, thisremote, button);
+		wanted.insert(thisremote);
+	}
+	// batch lines are only known as they arrive, so in real time mode
+	// every button is encoded up front unless -H names the hot ones
+	if ((priority > 0) && (batch.size() > 0) && hot.empty())
+	{
+		hot = "all";
+	}
+	std::vector<std::pair<std::string, std::string> > hotpresses = split_hot(hot, defaultremote, known);
+	for (auto &h : hotpresses)
+	{
+		wanted.insert(h.first);
+	}
+	load_remotes(wanted);
+
+	std::shared_ptr<const config_snapshot> config = current_remotes();
+	if (dumpconfig)
+	{
+		for (auto r:config->remotes)
+		{
+			const remote_config &remote(*r.second);
+			std::cout <<"Config for remote "<<r.first<<std::endl;
+			for (auto k:remote.config)
+			{
+				std::cout << "config: "<<k.first<<" "<<k.second<<std::endl;
 			}
-			else if (remote.flags.find("RC5") != remote.flags.end())
+			for (auto k:remote.codes)
 			{
-				std::string pattern("0x");
-				if (remote.config.find("pre_data") != remote.config.end())
-				{
-					// TODO support pre_data_bits not modulo 4
-					char xx[50];
-					snprintf(xx,sizeof(xx),"%0*x",(3+remote.config["bits"])/4,remote.config["pre_data"]);
-					pattern += xx;
-				}
-				pattern.append(code->second);
-				//std::cout << "pattern is "<<pattern<<std::endl;
-				if (irSlingPrepareRC5(irSignal, &pulseCount,
-							pin,
-							remote.config["frequency"],
-							double(remote.config["dutycycle"])/100,
-							remote.config["one.on"] + remote.config["one.off"],
-							pattern.c_str(),
-							remote.config["bits"] + remote.config["pre_data_bits"]))
+				std::cout << "code  : "<<k.first<<" "<<k.second<<std::endl;
+			}
+			for (auto k:remote.rawcodes)
+			{
+				std::cout << "raw   : "<<k.first;
+				irSlingUnpackRaw(remote.rawtimings.data(), remote.rawtimings.size(),
+					(const uint8_t *)k.second->data(), k.second->size(),
+					[](uint32_t duration, int, void *) { std::cout<<" "<<duration; }, nullptr);
+				std::cout<<std::endl;
+			}
+			std::cout << "heap  : "<<remote.heap_bytes()<<std::endl;
+		}
+	}
+	config.reset();
+
+	if (output.size() > 0)
+	{
+		std::vector<rendered_press> presses;
+		if (allbuttons)
+		{
+			config = current_remotes();
+			std::vector<std::string> names;
+			for (auto &r : config->remotes)
+			{
+				names.push_back(r.first);
+			}
+			std::sort(names.begin(), names.end());
+			for (auto &n : names)
+			{
+				for (auto &b : remote_buttons(*config->remotes.at(n)))
 				{
-					std::cerr << "Failed to prepare signal" <<std::endl;
-					continue;
+					rendered_press press;
+					press.remote = n;
+					press.button = b;
+					presses.push_back(press);
 				}
 			}
 		}
+		for (c=optind ; c < argc ; ++c)
+		{
+			rendered_press press;
+			split_button(argv[c], defaultremote, press.remote, press.button);
+			if (find_remote(press.remote) == nullptr)
+			{
+				std::cerr << "Remote " << press.remote << " does not exist" << std::endl;
+				exit(1);
+			}
+			presses.push_back(press);
+		}
 
-		int gap = remote.config["gap"];
-		if (remote.config.find("repeat_gap") != remote.config.end())
+		// a press that could not be rendered fails the run
+		int result = render_presses(presses, pin, output, vcd);
+		for (auto &p : presses)
 		{
-			gap = remote.config["repeat_gap"];
+			result |= (p.result != 0) ? 1 : 0;
 		}
+		return result;
+	}
+
+	send_options opts;
+	opts.pin = pin;
+	opts.verifypin = verifypin;
+	opts.tolerance = tolerance;
+	opts.retries = retries;
+	opts.segmented = segmented;
+	opts.schedule = schedule;
+	opts.deadline = deadline;
+
+	int result = -1;
+	transmitWavePre(pin);
+
+	if (hotpresses.size() > 0)
+	{
+		prewarm_presses(hotpresses, opts);
+	}
 
-		for(int i=0 ; i<=remote.config["min_repeat"]; ++i)
+	// in real time mode every press is encoded before anything is sent, so
+	// the transmit loop neither parses nor encodes and memory stays locked;
+	// batch lines are still read and looked up in the press cache on this
+	// thread, and one evicted by -M or reloaded by -w is encoded again here
+	std::vector<std::shared_ptr<const rendered_press> > prepared;
+	if (priority > 0)
+	{
+		for (c=optind ; c < argc ; ++c)
 		{
-			transmitWave(irSignal, pulseCount);
-			// only delay if repeating this press
-			if (i < remote.config["min_repeat"])
-			{
-				usleep(gap);
-			}
+			std::string button;
+			split_button(argv[c], defaultremote, thisremote, button);
+			prepared.push_back(lookup_press(thisremote, button, opts));
+		}
+		if (enter_realtime(priority, cpu))
+		{
+			exit(1);
 		}
+	}
+
+	if (batch.size() > 0)
+	{
+		result = run_batch(batch, defaultremote, opts);
+	}
 
-		// only delay if more buttons
-		if (c < (argc-1))
+	pacing pace;
+	for (c=optind ; c < argc ; ++c)
+	{
+		std::string button;
+		split_button(argv[c], defaultremote, thisremote, button);
+		// hold on to the press, and the remote it came from, for the whole
+		// press so that a reload cannot change it underneath us
+		std::shared_ptr<const rendered_press> press = (priority > 0) ? prepared[c - optind] : lookup_press(thisremote, button, opts);
+		if (press == nullptr)
+		{
+			std::cerr << "Remote " << thisremote << " does not exist" << std::endl;
+			exit(1);
+		}
+		if (press->result > 0)
+		{
+			std::cerr << "Button \"" << button << "\" is unknown on remote " << thisremote << std::endl;
+			result |= 1;
+			continue;
+		}
+		if (result == -1) { result = 0; }
+		if (press->result < 0)
 		{
-			usleep(remote.config["gap"]);
+			continue;
 		}
+
+		result |= send_press(*press, press->config->get("min_repeat"), opts, pace);
 	}
 
+	if (dumpconfig)
+	{
+		report_budget(std::cout);
+	}
+	prepared.clear();
+	release_all_waves();
 	transmitWavePost();
 	return result;
 }
-
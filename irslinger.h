@@ -5,12 +5,124 @@
 #include <math.h>
 #include <pigpio.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
 
 #define MAX_COMMAND_SIZE 512
 #define MAX_PULSES 12000
 
+#if defined(__cplusplus)
+#define IRSLINGER_THREAD_LOCAL thread_local
+#elif defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L
+#define IRSLINGER_THREAD_LOCAL _Thread_local
+#else
+#define IRSLINGER_THREAD_LOCAL __thread
+#endif
+
+// Static tracepoints for perf / bpftrace / systemtap, provider "irslinger".
+// Every probe carries remote, button, pulse count and the airtime (us) of
+// the pulse train so far, e.g.
+//   bpftrace -e 'usdt:./irsling:irslinger:wave__send { printf("%s.%s %d %d\\n",
+//       str(arg0), str(arg1), arg2, arg3); }'
+// When sys/sdt.h is available each probe is a test of its semaphore until
+// something attaches to it, and its arguments are only worked out then;
+// define IRSLINGER_NO_PROBES to compile them out entirely.
+#if !defined(IRSLINGER_NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+#define IRSLINGER_PROBES 1
+#endif
+#endif
+
+// What the probes report as the remote and button
+typedef struct
+{
+	const char *remote;
+	const char *button;
+} irSlingProbeContext_t;
+
+static inline irSlingProbeContext_t *irSlingProbeContext(void)
+{
+	static IRSLINGER_THREAD_LOCAL irSlingProbeContext_t context = { "", "" };
+	return &context;
+}
+
+// Label the probes fired by this thread from now on
+static inline void irSlingSetProbeContext(const char *remote, const char *button)
+{
+	irSlingProbeContext_t *context = irSlingProbeContext();
+	context->remote = remote ? remote : "";
+	context->button = button ? button : "";
+}
+
+#ifdef IRSLINGER_PROBES
+// The tracer sets a probe's semaphore while it is attached. The notes
+// refer to it by its plain name, which C++ would otherwise mangle.
+#define IRSLING_SEMAPHORE(name) \
+	static volatile unsigned short irslinger_##name##_semaphore \
+		__asm__("irslinger_" #name "_semaphore") __attribute__((used, section(".probes")))
+IRSLING_SEMAPHORE(prepare__start);
+IRSLING_SEMAPHORE(prepare__done);
+IRSLING_SEMAPHORE(burst__start);
+IRSLING_SEMAPHORE(burst__done);
+IRSLING_SEMAPHORE(wave__create__start);
+IRSLING_SEMAPHORE(wave__create__done);
+IRSLING_SEMAPHORE(wave__send);
+IRSLING_SEMAPHORE(wave__done);
+IRSLING_SEMAPHORE(gap__start);
+IRSLING_SEMAPHORE(gap__done);
+
+#define IRSLING_PROBE(name, pulses, airtime) \
+	do { \
+		if (__builtin_expect(irslinger_##name##_semaphore, 0)) \
+		{ \
+			STAP_PROBE4(irslinger, name, irSlingProbeContext()->remote, irSlingProbeContext()->button, \
+				(unsigned int)(pulses), (unsigned int)(airtime)); \
+		} \
+	} while (0)
+#else
+#define IRSLING_PROBE(name, pulses, airtime) do {} while (0)
+#endif
+
+// Length of a pulse train in microseconds
+static inline uint32_t waveMicros(const gpioPulse_t *irSignal, unsigned int pulseCount)
+{
+	uint32_t micros = 0;
+	unsigned int i;
+	for (i = 0; i < pulseCount; i++)
+	{
+		micros += irSignal[i].usDelay;
+	}
+	return micros;
+}
+
+// Airtime of a pulse train being built, for the probes; a train that has
+// outgrown its buffer counts up to the end of the buffer
+static inline uint32_t pulsesAirtime(const gpioPulse_t *irSignal, unsigned int pulseCount)
+{
+	return waveMicros(irSignal, (pulseCount > MAX_PULSES) ? MAX_PULSES : pulseCount);
+}
+
+// Pulse trains are built into buffers of MAX_PULSES. A train that does not
+// fit is marked by *pulseCount going past MAX_PULSES, after which nothing
+// more is written and the prepare functions fail.
+static inline int pulsesFit(unsigned int *pulseCount, unsigned int more)
+{
+	if (*pulseCount + more > MAX_PULSES)
+	{
+		*pulseCount = MAX_PULSES + 1;
+		return 0;
+	}
+	return 1;
+}
+
 static inline void addPulse(uint32_t onPins, uint32_t offPins, uint32_t duration, gpioPulse_t *irSignal, unsigned int *pulseCount)
 {
+	if (!pulsesFit(pulseCount, 1))
+	{
+		return;
+	}
 	int index = *pulseCount;
 
 	irSignal[index].gpioOn = onPins;
@@ -20,31 +132,167 @@ static inline void addPulse(uint32_t onPins, uint32_t offPins, uint32_t duration
 	(*pulseCount)++;
 }
 
-// Generates a square wave for duration (microseconds) at frequency (Hz)
-// on GPIO pin outPin. dutyCycle is a floating value between 0 and 1.
-static inline void carrierFrequency(uint32_t outPin, double frequency, double dutyCycle, double duration, gpioPulse_t *irSignal, unsigned int *pulseCount)
+// Number of carrier cycles held in each pre-built template run
+#define CARRIER_TEMPLATE_CYCLES 64
+// Number of (pin, frequency, duty) templates cached per thread
+#define CARRIER_TEMPLATE_SLOTS 4
+
+// One carrier cycle (on pulse + off pulse) for a given pin, frequency and
+// duty cycle, repeated CARRIER_TEMPLATE_CYCLES times so that bursts can be
+// emitted with a handful of bulk copies instead of one addPulse per edge.
+typedef struct
 {
-	double oneCycleTime = 1000000.0 / frequency; // 1000000 microseconds in a second
-	int onDuration = (int)round(oneCycleTime * dutyCycle);
-	int offDuration = (int)round(oneCycleTime * (1.0 - dutyCycle));
+	int valid;
+	uint32_t outPin;
+	double frequency;
+	double dutyCycle;
+	double oneCycleTime;
+	gpioPulse_t run[CARRIER_TEMPLATE_CYCLES * 2];
+} carrierTemplate_t;
 
-	int totalCycles = (int)round(duration / oneCycleTime);
-	int totalPulses = totalCycles * 2;
+// Find (or build) the template for this carrier. Templates are per thread
+// so concurrent encoders never share a slot.
+static inline const carrierTemplate_t *carrierTemplate(uint32_t outPin, double frequency, double dutyCycle)
+{
+	static IRSLINGER_THREAD_LOCAL carrierTemplate_t templates[CARRIER_TEMPLATE_SLOTS];
+	static IRSLINGER_THREAD_LOCAL unsigned int nextSlot = 0;
 
 	int i;
-	for (i = 0; i < totalPulses; i++)
+	for (i = 0; i < CARRIER_TEMPLATE_SLOTS; i++)
 	{
-		if (i % 2 == 0)
+		carrierTemplate_t *t = &templates[i];
+		if (t->valid && t->outPin == outPin && t->frequency == frequency && t->dutyCycle == dutyCycle)
 		{
-			// High pulse
-			addPulse(1 << outPin, 0, onDuration, irSignal, pulseCount);
-		}
-		else
-		{
-			// Low pulse
-			addPulse(0, 1 << outPin, offDuration, irSignal, pulseCount);
+			return t;
 		}
 	}
+
+	// not cached, replace the oldest slot
+	carrierTemplate_t *t = &templates[nextSlot];
+	nextSlot = (nextSlot + 1) % CARRIER_TEMPLATE_SLOTS;
+
+	t->outPin = outPin;
+	t->frequency = frequency;
+	t->dutyCycle = dutyCycle;
+	t->oneCycleTime = 1000000.0 / frequency; // 1000000 microseconds in a second
+	uint32_t onDuration = (uint32_t)round(t->oneCycleTime * dutyCycle);
+	uint32_t offDuration = (uint32_t)round(t->oneCycleTime * (1.0 - dutyCycle));
+	for (i = 0; i < CARRIER_TEMPLATE_CYCLES * 2; i += 2)
+	{
+		// High pulse
+		t->run[i].gpioOn = 1 << outPin;
+		t->run[i].gpioOff = 0;
+		t->run[i].usDelay = onDuration;
+		// Low pulse
+		t->run[i+1].gpioOn = 0;
+		t->run[i+1].gpioOff = 1 << outPin;
+		t->run[i+1].usDelay = offDuration;
+	}
+	t->valid = 1;
+	return t;
+}
+
+// Carrier synthesis modes
+// ROUNDED: every half cycle is rounded to whole microseconds and the burst
+//          to whole cycles (e.g. 13+13us at 38kHz, ~1.2% slow)
+// EXACT:   edges are placed on the rounded ideal timeline so the rounding
+//          error is carried forward; the average frequency is exact and
+//          every burst spans exactly its requested duration
+#define IRSLING_CARRIER_ROUNDED 0
+#define IRSLING_CARRIER_EXACT 1
+
+static inline int *carrierModeSetting(void)
+{
+	static int mode = IRSLING_CARRIER_ROUNDED;
+	return &mode;
+}
+
+// Select the carrier synthesis mode used by all subsequent encodes
+static inline void irSlingSetCarrierMode(int mode)
+{
+	*carrierModeSetting() = mode;
+}
+
+// Drift-free square wave for duration (microseconds) at frequency (Hz).
+// The final off half-cycle is stretched or shrunk so the burst ends exactly
+// duration microseconds after it started.
+static inline void carrierFrequencyExact(uint32_t outPin, double frequency, double dutyCycle, double duration, gpioPulse_t *irSignal, unsigned int *pulseCount)
+{
+	double oneCycleTime = 1000000.0 / frequency; // 1000000 microseconds in a second
+	double onTime = oneCycleTime * dutyCycle;
+	long burstEnd = lround(duration);
+
+	// only send cycles whose on half fits within the burst
+	int totalCycles = (int)round(duration / oneCycleTime);
+	while ((totalCycles > 0) && (lround((totalCycles - 1) * oneCycleTime + onTime) > burstEnd))
+	{
+		totalCycles--;
+	}
+	if (!pulsesFit(pulseCount, totalCycles * 2))
+	{
+		return;
+	}
+
+	gpioPulse_t *out = irSignal + *pulseCount;
+	long rise = 0;
+	int i;
+	for (i = 0; i < totalCycles; i++)
+	{
+		long fall = lround(i * oneCycleTime + onTime);
+		long nextRise = (i == totalCycles - 1) ? burstEnd : lround((i + 1) * oneCycleTime);
+
+		// High pulse
+		out->gpioOn = 1 << outPin;
+		out->gpioOff = 0;
+		out->usDelay = fall - rise;
+		out++;
+		// Low pulse
+		out->gpioOn = 0;
+		out->gpioOff = 1 << outPin;
+		out->usDelay = nextRise - fall;
+		out++;
+
+		rise = nextRise;
+	}
+
+	*pulseCount += totalCycles * 2;
+}
+
+// Generates a square wave for duration (microseconds) at frequency (Hz)
+// on GPIO pin outPin. dutyCycle is a floating value between 0 and 1.
+static inline void carrierFrequency(uint32_t outPin, double frequency, double dutyCycle, double duration, gpioPulse_t *irSignal, unsigned int *pulseCount)
+{
+	IRSLING_PROBE(burst__start, *pulseCount, pulsesAirtime(irSignal, *pulseCount));
+	if (*carrierModeSetting() == IRSLING_CARRIER_EXACT)
+	{
+		carrierFrequencyExact(outPin, frequency, dutyCycle, duration, irSignal, pulseCount);
+		IRSLING_PROBE(burst__done, *pulseCount, pulsesAirtime(irSignal, *pulseCount));
+		return;
+	}
+
+	const carrierTemplate_t *t = carrierTemplate(outPin, frequency, dutyCycle);
+
+	int totalCycles = (int)round(duration / t->oneCycleTime);
+	if ((totalCycles <= 0) || !pulsesFit(pulseCount, totalCycles * 2))
+	{
+		IRSLING_PROBE(burst__done, *pulseCount, pulsesAirtime(irSignal, *pulseCount));
+		return;
+	}
+
+	// copy whole template runs, then the remainder; memcpy is vectorised
+	// by the C library wherever the target supports it
+	gpioPulse_t *out = irSignal + *pulseCount;
+	int remaining = totalCycles;
+	while (remaining >= CARRIER_TEMPLATE_CYCLES)
+	{
+		memcpy(out, t->run, sizeof(t->run));
+		out += CARRIER_TEMPLATE_CYCLES * 2;
+		remaining -= CARRIER_TEMPLATE_CYCLES;
+	}
+	memcpy(out, t->run, remaining * 2 * sizeof(gpioPulse_t));
+
+	*pulseCount += totalCycles * 2;
+	IRSLING_PROBE(burst__done, *pulseCount, pulsesAirtime(irSignal, *pulseCount));
 }
 
 // bitnum is 0 based
@@ -117,16 +365,497 @@ static inline int transmitWavePre(uint32_t outPin)
 	return 0;
 }
 
-static inline int transmitWave(gpioPulse_t *irSignal, unsigned int pulseCount)
+
+// Wait for a wave of the given length to finish transmitting: sleep
+// through most of it in one go, then poll for the end
+static inline void waitWaveDone(uint32_t micros)
+{
+	if (micros > 2000)
+	{
+		time_sleep((micros - 1000) / 1000000.0);
+	}
+	while (gpioWaveTxBusy())
+	{
+		time_sleep(0.0005);
+	}
+}
+
+// Wave budget: every wave that exists holds pulses and DMA control blocks
+// from one pool in pigpio, and gpioWaveCreate() just fails once that runs
+// out. Waves made with irSlingCreateWave() are accounted against a budget,
+// by default the whole pool, and frames that do not fit in what is left
+// are sent in chunks rather than failing.
+// pigpio hands out the pool like a stack: a new wave takes resources above
+// the highest wave still held, and gpioWaveDelete() only flags a wave, its
+// resources going back once every wave above it has gone too. A new wave of
+// exactly the same shape as a flagged one takes over its slot instead. The
+// accounting follows the same rules, so a deleted wave is still counted
+// until pigpio has really reclaimed it.
+#ifndef PI_WAVE_MODE_ONE_SHOT_SYNC
+#define PI_WAVE_MODE_ONE_SHOT_SYNC 2
+#endif
+// pigpio's PI_MAX_WAVES
+#define IRSLING_MAX_WAVES 250
+// irSlingCreateWave() result when the wave would exceed the budget
+#define IRSLING_OVER_BUDGET -1000
+// what a wave ID holds, as irSlingGetWaveSize() reports it
+#define IRSLING_WAVE_FREE 0
+#define IRSLING_WAVE_LIVE 1
+// deleted, but still held as a wave above it is not
+#define IRSLING_WAVE_DELETED 2
+
+typedef struct
+{
+	unsigned int waves;     // waves currently created
+	unsigned int pulses;    // pulses held by them and by deleted waves pigpio has yet to reclaim
+	unsigned int cbs;       // control blocks held likewise (estimated)
+	unsigned int maxPulses; // the budget in force
+	unsigned int maxCbs;
+	unsigned int chunked;   // frames sent in chunks to fit the budget
+	unsigned int deleted;   // deleted waves pigpio has yet to reclaim
+} irSlingWaveUsage_t;
+
+typedef struct
+{
+	irSlingWaveUsage_t usage;
+	// budget set with irSlingSetWaveBudget(), 0 for pigpio's limit
+	unsigned int maxPulses;
+	unsigned int maxCbs;
+	// one past the highest wave ID holding resources
+	int top;
+	unsigned char waveState[IRSLING_MAX_WAVES];
+	unsigned int wavePulses[IRSLING_MAX_WAVES];
+	unsigned int waveCbs[IRSLING_MAX_WAVES];
+	unsigned int waveLevels[IRSLING_MAX_WAVES];
+} irSlingWaveBudget_t;
+
+// pigpio's pool is shared by the whole process, and so is its accounting
+static inline irSlingWaveBudget_t *waveBudget(void)
 {
-	// Start a new wave
-	gpioWaveClear();
+	static irSlingWaveBudget_t budget;
+	return &budget;
+}
+
+// Limit the pulses and control blocks held by waves made here; 0 leaves
+// that limit at pigpio's. A budget below pigpio's leaves room for others.
+static inline void irSlingSetWaveBudget(unsigned int maxPulses, unsigned int maxCbs)
+{
+	waveBudget()->maxPulses = maxPulses;
+	waveBudget()->maxCbs = maxCbs;
+}
+
+static inline unsigned int waveBudgetLimit(unsigned int budget, int pigpio)
+{
+	return ((budget > 0) && (budget < (unsigned int)pigpio)) ? budget : (unsigned int)pigpio;
+}
+
+// Control blocks pigpio needs for a pulse train: one for each level change
+// and one for each delay, plus a couple per wave (as its wave2Cbs)
+static inline unsigned int irSlingWaveCbs(const gpioPulse_t *irSignal, unsigned int pulseCount)
+{
+	unsigned int cbs = 2;
+	unsigned int i;
+	for (i = 0; i < pulseCount; i++)
+	{
+		cbs += (irSignal[i].gpioOn != 0) + (irSignal[i].gpioOff != 0) + (irSignal[i].usDelay != 0);
+	}
+	return cbs;
+}
+
+// Level changes in a pulse train, each taking one of pigpio's OOL words;
+// with the control blocks this is the shape pigpio matches deleted waves on
+static inline unsigned int irSlingWaveLevels(const gpioPulse_t *irSignal, unsigned int pulseCount)
+{
+	unsigned int levels = 0;
+	unsigned int i;
+	for (i = 0; i < pulseCount; i++)
+	{
+		levels += (irSignal[i].gpioOn != 0) + (irSignal[i].gpioOff != 0);
+	}
+	return levels;
+}
+
+// Waves, pulses and control blocks currently held, and the budget
+static inline void irSlingGetWaveUsage(irSlingWaveUsage_t *usage)
+{
+	irSlingWaveBudget_t *budget = waveBudget();
+	*usage = budget->usage;
+	usage->maxPulses = waveBudgetLimit(budget->maxPulses, gpioWaveGetMaxPulses());
+	usage->maxCbs = waveBudgetLimit(budget->maxCbs, gpioWaveGetMaxCbs());
+}
+
+// Pulses and control blocks held by one wave. Returns IRSLING_WAVE_LIVE if
+// the wave was made with irSlingCreateWave() and not yet deleted,
+// IRSLING_WAVE_DELETED if it was deleted but pigpio still holds it, and
+// IRSLING_WAVE_FREE (with no pulses or control blocks) otherwise.
+static inline int irSlingGetWaveSize(int waveID, unsigned int *pulses, unsigned int *cbs)
+{
+	int state = ((waveID >= 0) && (waveID < IRSLING_MAX_WAVES)) ? waveBudget()->waveState[waveID] : IRSLING_WAVE_FREE;
+	*pulses = (state != IRSLING_WAVE_FREE) ? waveBudget()->wavePulses[waveID] : 0;
+	*cbs = (state != IRSLING_WAVE_FREE) ? waveBudget()->waveCbs[waveID] : 0;
+	return state;
+}
 
+// A deleted wave whose slot pigpio would reuse for a wave of this shape,
+// the first such as pigpio takes, or -1 if none
+static inline int waveExactFit(unsigned int cbs, unsigned int levels)
+{
+	irSlingWaveBudget_t *budget = waveBudget();
+	int id;
+	for (id = 0; id < budget->top; id++)
+	{
+		if ((budget->waveState[id] == IRSLING_WAVE_DELETED) &&
+			(budget->waveCbs[id] == cbs) && (budget->waveLevels[id] == levels))
+		{
+			return id;
+		}
+	}
+	return -1;
+}
+
+// Whether a wave of this size and shape fits in what is left of the budget,
+// or in the slot of a deleted wave
+static inline int waveFitsWhole(unsigned int pulseCount, unsigned int cbs, unsigned int levels)
+{
+	irSlingWaveUsage_t usage;
+	irSlingGetWaveUsage(&usage);
+	return (waveExactFit(cbs, levels) >= 0) ||
+		((usage.pulses + pulseCount <= usage.maxPulses) && (usage.cbs + cbs <= usage.maxCbs) &&
+		 (waveBudget()->top < IRSLING_MAX_WAVES));
+}
+
+// Create a wave from irSignal without touching existing waves.
+// Returns the wave ID, IRSLING_OVER_BUDGET if it does not fit in the
+// budget or pigpio has no room for it, or another negative pigpio error.
+static inline int irSlingCreateWave(gpioPulse_t *irSignal, unsigned int pulseCount)
+{
+	irSlingWaveBudget_t *budget = waveBudget();
+	unsigned int cbs = irSlingWaveCbs(irSignal, pulseCount);
+	unsigned int levels = irSlingWaveLevels(irSignal, pulseCount);
+	if (!waveFitsWhole(pulseCount, cbs, levels))
+	{
+		return IRSLING_OVER_BUDGET;
+	}
+
+	gpioWaveAddNew();
 	gpioWaveAddGeneric(pulseCount, irSignal);
+	IRSLING_PROBE(wave__create__start, pulseCount, waveMicros(irSignal, pulseCount));
 	int waveID = gpioWaveCreate();
+	IRSLING_PROBE(wave__create__done, pulseCount, waveMicros(irSignal, pulseCount));
 
-	if (waveID >= 0)
+	// pigpio out of room despite the budget (waves made elsewhere, or
+	// the estimate short) is handled just like being over budget
+	if ((waveID == PI_TOO_MANY_CBS) || (waveID == PI_TOO_MANY_OOL) || (waveID == PI_NO_WAVEFORM_ID))
+	{
+		return IRSLING_OVER_BUDGET;
+	}
+	if ((waveID >= 0) && (waveID < IRSLING_MAX_WAVES))
+	{
+		if (budget->waveState[waveID] == IRSLING_WAVE_DELETED)
+		{
+			// took over a deleted wave's slot and the resources it held
+			budget->usage.deleted--;
+			budget->usage.pulses -= budget->wavePulses[waveID];
+			budget->usage.cbs -= budget->waveCbs[waveID];
+		}
+		else if (waveID >= budget->top)
+		{
+			budget->top = waveID + 1;
+		}
+		budget->waveState[waveID] = IRSLING_WAVE_LIVE;
+		budget->wavePulses[waveID] = pulseCount;
+		budget->waveCbs[waveID] = cbs;
+		budget->waveLevels[waveID] = levels;
+		budget->usage.waves++;
+		budget->usage.pulses += pulseCount;
+		budget->usage.cbs += cbs;
+	}
+	return waveID;
+}
+
+// Delete a wave made with irSlingCreateWave(). Like pigpio it only returns
+// to the budget once no wave above it is left.
+static inline void irSlingDeleteWave(int waveID)
+{
+	irSlingWaveBudget_t *budget = waveBudget();
+	if ((waveID >= 0) && (waveID < IRSLING_MAX_WAVES) && (budget->waveState[waveID] == IRSLING_WAVE_LIVE))
+	{
+		budget->waveState[waveID] = IRSLING_WAVE_DELETED;
+		budget->usage.waves--;
+		budget->usage.deleted++;
+		while ((budget->top > 0) && (budget->waveState[budget->top - 1] == IRSLING_WAVE_DELETED))
+		{
+			int id = --budget->top;
+			budget->waveState[id] = IRSLING_WAVE_FREE;
+			budget->usage.deleted--;
+			budget->usage.pulses -= budget->wavePulses[id];
+			budget->usage.cbs -= budget->waveCbs[id];
+			budget->wavePulses[id] = 0;
+			budget->waveCbs[id] = 0;
+			budget->waveLevels[id] = 0;
+		}
+	}
+	gpioWaveDelete(waveID);
+}
+
+// A chunk is queued while the one before it plays, so each but the last
+// must play for at least this long (us) to leave time to create the next
+#define IRSLING_MIN_CHUNK_MICROS 5000
+// Chunks after the first are made the same shape, so each takes over the
+// slot of the one two before it; with the last, which may not match, that
+// leaves at most three held at once
+#define IRSLING_CHUNKS_HELD 3
+
+// The chunk of irSignal starting at pulse start holding at most levels
+// level changes. Returns the index after it, with its control blocks, the
+// pulses whose delay could be split to pad it, and its airtime.
+static inline unsigned int waveChunkEnd(const gpioPulse_t *irSignal, unsigned int pulseCount, unsigned int start,
+	unsigned int levels, unsigned int *cbs, unsigned int *splittable, uint32_t *micros)
+{
+	unsigned int used = 0;
+	unsigned int i;
+	*cbs = 2;
+	*splittable = 0;
+	*micros = 0;
+	for (i = start; i < pulseCount; i++)
+	{
+		unsigned int changes = (irSignal[i].gpioOn != 0) + (irSignal[i].gpioOff != 0);
+		if ((used + changes > levels) && (i > start))
+		{
+			break;
+		}
+		used += changes;
+		*cbs += changes + (irSignal[i].usDelay != 0);
+		*splittable += (irSignal[i].usDelay >= 2);
+		*micros += irSignal[i].usDelay;
+	}
+	return i;
+}
+
+typedef struct
+{
+	unsigned int chunks;
+	// control blocks every chunk but the last is padded to
+	unsigned int padCbs;
+	// the most pulses and control blocks any chunk holds once padded
+	unsigned int maxPulses;
+	unsigned int maxCbs;
+	// airtime of the shortest chunk but the last (us)
+	uint32_t shortestMicros;
+} irSlingChunkPlan_t;
+
+static inline void waveChunkPlan(const gpioPulse_t *irSignal, unsigned int pulseCount, unsigned int levels, irSlingChunkPlan_t *plan)
+{
+	unsigned int start = 0;
+	memset(plan, 0, sizeof(*plan));
+	plan->shortestMicros = UINT32_MAX;
+	while (start < pulseCount)
 	{
+		unsigned int cbs, splittable;
+		uint32_t micros;
+		unsigned int end = waveChunkEnd(irSignal, pulseCount, start, levels, &cbs, &splittable, &micros);
+		if (end < pulseCount)
+		{
+			if (cbs > plan->padCbs) plan->padCbs = cbs;
+			if (micros < plan->shortestMicros) plan->shortestMicros = micros;
+		}
+		start = end;
+		plan->chunks++;
+	}
+	// padding adds a pulse and a control block per split delay
+	start = 0;
+	while (start < pulseCount)
+	{
+		unsigned int cbs, splittable;
+		uint32_t micros;
+		unsigned int end = waveChunkEnd(irSignal, pulseCount, start, levels, &cbs, &splittable, &micros);
+		unsigned int pad = 0;
+		if (end < pulseCount)
+		{
+			pad = plan->padCbs - cbs;
+			pad = (pad < splittable) ? pad : splittable;
+		}
+		if (end - start + pad > plan->maxPulses) plan->maxPulses = end - start + pad;
+		if (cbs + pad > plan->maxCbs) plan->maxCbs = cbs + pad;
+		start = end;
+	}
+}
+
+// Send the chunks of a plan back to back. Returns 0 once sent, 1 on
+// failure or if a chunk was queued too late and left a gap in the frame,
+// or IRSLING_OVER_BUDGET if there was no room for the first chunk.
+static inline int waveSendChunks(gpioPulse_t *irSignal, unsigned int pulseCount, unsigned int levels, const irSlingChunkPlan_t *plan)
+{
+	// a chunk is copied here to pad it by splitting delays, which adds
+	// control blocks without changing its timing
+	static gpioPulse_t padded[MAX_PULSES];
+	int previous = -1;
+	int late = 0;
+	unsigned int start = 0;
+	uint32_t lastMicros = 0;
+	while (start < pulseCount)
+	{
+		unsigned int cbs, splittable;
+		uint32_t micros;
+		unsigned int end = waveChunkEnd(irSignal, pulseCount, start, levels, &cbs, &splittable, &micros);
+		unsigned int pad = (end < pulseCount) ? plan->padCbs - cbs : 0;
+		unsigned int n = 0;
+		unsigned int i;
+		for (i = start; i < end; i++)
+		{
+			padded[n] = irSignal[i];
+			if ((pad > 0) && (irSignal[i].usDelay >= 2))
+			{
+				padded[n].usDelay--;
+				n++;
+				padded[n].gpioOn = 0;
+				padded[n].gpioOff = 0;
+				padded[n].usDelay = 1;
+				pad--;
+			}
+			n++;
+		}
+
+		int waveID = irSlingCreateWave(padded, n);
+		if (waveID < 0)
+		{
+			if ((previous < 0) && (waveID == IRSLING_OVER_BUDGET))
+			{
+				return IRSLING_OVER_BUDGET;
+			}
+			printf("Wave creation failure!\n %i", waveID);
+			gpioWaveTxStop();
+			if (previous >= 0)
+			{
+				irSlingDeleteWave(previous);
+			}
+			return 1;
+		}
+		if ((previous >= 0) && !gpioWaveTxBusy())
+		{
+			late = 1;
+		}
+		gpioWaveTxSend(waveID, (previous < 0) ? PI_WAVE_MODE_ONE_SHOT : PI_WAVE_MODE_ONE_SHOT_SYNC);
+		if (previous >= 0)
+		{
+			// the previous chunk can only go once this one has taken over
+			while (gpioWaveTxAt() == previous)
+			{
+				time_sleep(0.0005);
+			}
+			irSlingDeleteWave(previous);
+		}
+		previous = waveID;
+		lastMicros = micros;
+		start = end;
+	}
+
+	waitWaveDone(lastMicros);
+	irSlingDeleteWave(previous);
+	if (late)
+	{
+		printf("Wave chunk queued too late, gap in frame!\n");
+	}
+	return late;
+}
+
+// The level changes per chunk, from levels down (or from what the budget
+// allows if levels is 0), at which IRSLING_CHUNKS_HELD chunks fit in what is
+// left of the budget, with the plan for them; 0 if there are none, or if
+// chunks that fit would play for less than IRSLING_MIN_CHUNK_MICROS.
+static inline unsigned int waveChunkLevels(const gpioPulse_t *irSignal, unsigned int pulseCount,
+	unsigned int levels, irSlingChunkPlan_t *plan)
+{
+	irSlingWaveUsage_t usage;
+	irSlingGetWaveUsage(&usage);
+	unsigned int freePulses = (usage.maxPulses > usage.pulses) ? (usage.maxPulses - usage.pulses) : 0;
+	unsigned int freeCbs = (usage.maxCbs > usage.cbs) ? (usage.maxCbs - usage.cbs) : 0;
+	if (levels == 0)
+	{
+		// a level change takes a control block, and mostly a delay another
+		levels = freePulses / IRSLING_CHUNKS_HELD;
+		if (freeCbs / IRSLING_CHUNKS_HELD / 2 < levels)
+		{
+			levels = freeCbs / IRSLING_CHUNKS_HELD / 2;
+		}
+	}
+	memset(plan, 0, sizeof(*plan));
+	for (; levels > 0; levels = levels * 3 / 4)
+	{
+		waveChunkPlan(irSignal, pulseCount, levels, plan);
+		if ((plan->chunks > 1) && (plan->shortestMicros < IRSLING_MIN_CHUNK_MICROS))
+		{
+			return 0;
+		}
+		if ((plan->maxPulses * IRSLING_CHUNKS_HELD <= freePulses) && (plan->maxCbs * IRSLING_CHUNKS_HELD <= freeCbs) &&
+			(plan->maxPulses <= MAX_PULSES))
+		{
+			return levels;
+		}
+	}
+	return 0;
+}
+
+// Whether transmitWave() could send irSignal now, whole or in chunks
+static inline int irSlingWaveFits(const gpioPulse_t *irSignal, unsigned int pulseCount)
+{
+	irSlingChunkPlan_t plan;
+	return waveFitsWhole(pulseCount, irSlingWaveCbs(irSignal, pulseCount), irSlingWaveLevels(irSignal, pulseCount)) ||
+		(waveChunkLevels(irSignal, pulseCount, 0, &plan) > 0);
+}
+
+// Send a frame too big for what is left of the budget as consecutive
+// chunks, each queued with PI_WAVE_MODE_ONE_SHOT_SYNC behind the one before
+// so they follow on without a gap. The chunks are as big as the budget
+// allows for IRSLING_CHUNKS_HELD of them; if that makes them too short to
+// queue each in time, the frame is not sent.
+static inline int transmitWaveChunked(gpioPulse_t *irSignal, unsigned int pulseCount)
+{
+	irSlingChunkPlan_t plan;
+	unsigned int levels = 0;
+
+	IRSLING_PROBE(wave__send, pulseCount, waveMicros(irSignal, pulseCount));
+	while ((levels = waveChunkLevels(irSignal, pulseCount, levels, &plan)) > 0)
+	{
+		int ret = waveSendChunks(irSignal, pulseCount, levels, &plan);
+		if (ret != IRSLING_OVER_BUDGET)
+		{
+			IRSLING_PROBE(wave__done, pulseCount, waveMicros(irSignal, pulseCount));
+			waveBudget()->usage.chunked++;
+			return ret;
+		}
+		// pigpio had less room than the budget: try smaller chunks
+		levels = levels * 3 / 4;
+		if (levels == 0)
+		{
+			break;
+		}
+	}
+	if ((plan.chunks > 1) && (plan.shortestMicros < IRSLING_MIN_CHUNK_MICROS))
+	{
+		printf("Wave budget too small to send frame in chunks of %ius!\n", IRSLING_MIN_CHUNK_MICROS);
+	}
+	else
+	{
+		printf("Wave budget exhausted!\n");
+	}
+	return 1;
+}
+
+static inline int transmitWave(gpioPulse_t *irSignal, unsigned int pulseCount)
+{
+	uint32_t micros = waveMicros(irSignal, pulseCount);
+
+	// Start a new wave, leaving any other waves in place
+	int waveID = irSlingCreateWave(irSignal, pulseCount);
+
+	if (waveID == IRSLING_OVER_BUDGET)
+	{
+		return transmitWaveChunked(irSignal, pulseCount);
+	}
+	else if (waveID >= 0)
+	{
+		IRSLING_PROBE(wave__send, pulseCount, micros);
 		int result = gpioWaveTxSend(waveID, PI_WAVE_MODE_ONE_SHOT);
 
 		//printf("Result: %i\n", result);
@@ -138,19 +867,206 @@ static inline int transmitWave(gpioPulse_t *irSignal, unsigned int pulseCount)
 	}
 
 	// Wait for the wave to finish transmitting
-	while (gpioWaveTxBusy())
-	{
-		time_sleep(0.1);
-	}
+	waitWaveDone(micros);
+	IRSLING_PROBE(wave__done, pulseCount, micros);
 
 	// Delete the wave if it exists
 	if (waveID >= 0)
 	{
-		gpioWaveDelete(waveID);
+		irSlingDeleteWave(waveID);
+	}
+	return 0;
+}
+
+// Segment waves: parts of a frame that are the same for every press can be
+// created as waves once and each press sent as a chain of their wave IDs.
+// gpioWaveChain() accepts at most this many bytes, one per wave ID.
+#define MAX_CHAIN 600
+
+// Send the waves listed in chain back to back and wait for them to finish.
+// micros is the total length of the chain.
+static inline int transmitWaveChain(char *chain, unsigned int chainLen, uint32_t micros)
+{
+	if (chainLen > MAX_CHAIN)
+	{
+		// Chain is too long
+		return 1;
+	}
+
+	IRSLING_PROBE(wave__send, chainLen, micros);
+	int result = gpioWaveChain(chain, chainLen);
+	if (result != 0)
+	{
+		printf("Wave chain failure!\n %i", result);
+		return 1;
+	}
+
+	// Wait for the chain to finish transmitting
+	waitWaveDone(micros);
+	IRSLING_PROBE(wave__done, chainLen, micros);
+	return 0;
+}
+
+// Scheduled sending: start a chain at an exact gpioTick(). The thread
+// sleeps until shortly before the deadline, then the rest of the wait is
+// put in front of the waves as chain delay commands so DMA starts them on
+// time; the first edge on outPin is captured to report the actual start.
+// gpioWaveChain() delays are at most 65535us each
+#define CHAIN_MAX_DELAY 65535
+// how long before the deadline the chain is handed to pigpio
+#define SCHEDULE_LEAD_US 10000
+
+typedef struct
+{
+	volatile int seen;
+	volatile uint32_t tick;
+} irSlingFirstEdge_t;
+
+static inline void irSlingCaptureFirstEdge(int gpio, int level, uint32_t tick, void *userdata)
+{
+	irSlingFirstEdge_t *edge = (irSlingFirstEdge_t *)userdata;
+	if (level == 1 && !edge->seen)
+	{
+		edge->tick = tick;
+		edge->seen = 1;
+	}
+}
+
+#ifdef CLOCK_MONOTONIC
+// The gpioTick() corresponding to a CLOCK_MONOTONIC time. Ticks wrap every
+// 2^32us, so the deadline must be less than 2^31us (about 35 minutes) away.
+static inline uint32_t irSlingTickAt(const struct timespec *deadline)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	uint32_t tick = gpioTick();
+	int64_t delta = (int64_t)(deadline->tv_sec - now.tv_sec) * 1000000 + (deadline->tv_nsec - now.tv_nsec) / 1000;
+	return tick + (uint32_t)delta;
+}
+#endif
+
+// Send the waves listed in chain so that they start at startTick.
+// *actualStart is set to the tick the first edge appeared on outPin.
+// A deadline already in the past (or 2^31us or more ahead) sends at once.
+// Returns 0, 1 if sending failed, or 2 if the waves were sent but no edge
+// was seen on outPin, leaving *actualStart unset.
+static inline int transmitWaveChainAt(char *chain, unsigned int chainLen, uint32_t micros,
+	uint32_t startTick, uint32_t outPin, uint32_t *actualStart)
+{
+	// sleep through most of the wait
+	int32_t remaining = (int32_t)(startTick - gpioTick());
+	if (remaining > SCHEDULE_LEAD_US)
+	{
+		time_sleep((remaining - SCHEDULE_LEAD_US) / 1000000.0);
+	}
+
+	irSlingFirstEdge_t edge = { 0, 0 };
+	gpioSetAlertFuncEx(outPin, irSlingCaptureFirstEdge, &edge);
+
+	char scheduled[MAX_CHAIN];
+	unsigned int len = 0;
+	uint32_t submitTick = gpioTick();
+	remaining = (int32_t)(startTick - submitTick);
+	while (remaining > 0)
+	{
+		uint32_t delay = remaining > CHAIN_MAX_DELAY ? CHAIN_MAX_DELAY : remaining;
+		if (len + 4 + chainLen > MAX_CHAIN)
+		{
+			break;
+		}
+		scheduled[len++] = (char)255;
+		scheduled[len++] = 2;
+		scheduled[len++] = delay & 0xff;
+		scheduled[len++] = delay >> 8;
+		remaining -= delay;
+	}
+	uint32_t lead = startTick - submitTick - (remaining > 0 ? remaining : 0);
+	if ((int32_t)lead < 0)
+	{
+		// late
+		lead = 0;
+	}
+	if (len + chainLen > MAX_CHAIN)
+	{
+		// Chain is too long
+		gpioSetAlertFuncEx(outPin, NULL, NULL);
+		return 1;
+	}
+	memcpy(scheduled + len, chain, chainLen);
+	len += chainLen;
+
+	IRSLING_PROBE(wave__send, chainLen, micros);
+	int result = gpioWaveChain(scheduled, len);
+	if (result != 0)
+	{
+		gpioSetAlertFuncEx(outPin, NULL, NULL);
+		printf("Wave chain failure!\n %i", result);
+		return 1;
+	}
+
+	waitWaveDone(lead + micros);
+	IRSLING_PROBE(wave__done, chainLen, micros);
+	// alerts are delivered from a buffer, let the first edge arrive
+	time_sleep(0.01);
+	gpioSetAlertFuncEx(outPin, NULL, NULL);
+
+	if (!edge.seen)
+	{
+		// sent, but when it started is unknown
+		return 2;
+	}
+	if (actualStart)
+	{
+		*actualStart = edge.tick;
 	}
 	return 0;
 }
 
+// As transmitWave, starting at startTick (see transmitWaveChainAt for the
+// return values)
+static inline int transmitWaveAt(gpioPulse_t *irSignal, unsigned int pulseCount,
+	uint32_t startTick, uint32_t outPin, uint32_t *actualStart)
+{
+	int waveID = irSlingCreateWave(irSignal, pulseCount);
+	if (waveID == IRSLING_OVER_BUDGET)
+	{
+		// too big for what is left of the budget: start it in chunks as
+		// near startTick as sleeping gets, and measure when it did start
+		int32_t remaining = (int32_t)(startTick - gpioTick());
+		if (remaining > 0)
+		{
+			time_sleep(remaining / 1000000.0);
+		}
+		irSlingFirstEdge_t edge = { 0, 0 };
+		gpioSetAlertFuncEx(outPin, irSlingCaptureFirstEdge, &edge);
+		int ret = transmitWaveChunked(irSignal, pulseCount);
+		time_sleep(0.01);
+		gpioSetAlertFuncEx(outPin, NULL, NULL);
+		if (ret)
+		{
+			return 1;
+		}
+		if (!edge.seen)
+		{
+			return 2;
+		}
+		if (actualStart)
+		{
+			*actualStart = edge.tick;
+		}
+		return 0;
+	}
+	if (waveID < 0)
+	{
+		printf("Wave creation failure!\n %i", waveID);
+		return 1;
+	}
+	char chain[1] = { (char)waveID };
+	int ret = transmitWaveChainAt(chain, 1, waveMicros(irSignal, pulseCount), startTick, outPin, actualStart);
+	irSlingDeleteWave(waveID);
+	return ret;
+}
+
 static inline int transmitWavePost()
 {
 	// Cleanup
@@ -158,6 +1074,403 @@ static inline int transmitWavePost()
 	return 0;
 }
 
+// Loopback verification: the output pin is wired back to an input pin and
+// the edges seen there are compared with the intended pulse train
+typedef struct
+{
+	uint32_t tick;
+	int level;
+} irSlingEdge_t;
+
+typedef struct
+{
+	irSlingEdge_t edges[MAX_PULSES];
+	volatile unsigned int count;
+} irSlingCapture_t;
+
+typedef struct
+{
+	unsigned int expectedEdges;
+	unsigned int capturedEdges;
+	// expected edges with no matching captured edge
+	unsigned int droppedEdges;
+	// rms and worst deviation of the matched edges (us)
+	double jitter;
+	int maxError;
+	// deviation of the last matched edge less that of the first (us)
+	int drift;
+	// no dropped edges and every edge within tolerance
+	int withinTolerance;
+} irSlingVerifyResult_t;
+
+static inline void irSlingCaptureEdge(int gpio, int level, uint32_t tick, void *userdata)
+{
+	irSlingCapture_t *capture = (irSlingCapture_t *)userdata;
+	// level 2 is a watchdog timeout, not an edge
+	if (level == 2 || capture->count >= MAX_PULSES)
+	{
+		return;
+	}
+	capture->edges[capture->count].tick = tick;
+	capture->edges[capture->count].level = level;
+	capture->count++;
+}
+
+// expected rising edges the first captured rising edge may be aligned with,
+// in case the first few carrier cycles were missed
+#define IRSLING_VERIFY_ANCHORS 4
+
+// Match captured edges, from the first rising one, against the edges of
+// irSignal on outPin with that captured edge taken to be expected edge
+// anchor; an expected edge is matched by the nearest captured edge of the
+// same level within window (us) of where the average of recent errors puts
+// it, so slow drift is followed rather than lost.
+static inline void irSlingMatchCapture(const gpioPulse_t *irSignal, unsigned int pulseCount, uint32_t mask,
+	const irSlingCapture_t *capture, unsigned int start, unsigned int anchor, int window,
+	irSlingVerifyResult_t *result)
+{
+	int level = 0;
+	uint32_t now = 0;
+	uint32_t expectedStart = 0;
+	unsigned int captured = start;
+	int firstError = 0;
+	int lastError = 0;
+	double sumSquares = 0;
+	double recent = 0;
+	unsigned int matched = 0;
+	unsigned int edge = 0;
+	unsigned int i;
+
+	memset(result, 0, sizeof(*result));
+	result->capturedEdges = capture->count;
+
+	for (i = 0; i < pulseCount; i++)
+	{
+		int next = level;
+		if (irSignal[i].gpioOn & mask) next = 1;
+		if (irSignal[i].gpioOff & mask) next = 0;
+		if (next != level)
+		{
+			level = next;
+			result->expectedEdges++;
+			if (edge++ == anchor)
+			{
+				expectedStart = now;
+			}
+			int32_t expected = now - expectedStart;
+			int track = (int)floor(recent + 0.5);
+			int32_t centre = expected + track;
+			if (edge <= anchor)
+			{
+				// before the anchor, so never captured
+				result->droppedEdges++;
+				now += irSignal[i].usDelay;
+				continue;
+			}
+
+			// skip captured edges that are too early to be this one
+			while (captured < capture->count &&
+				(int32_t)(capture->edges[captured].tick - capture->edges[start].tick) < centre - window)
+			{
+				captured++;
+			}
+			// the nearest edge of this level within the window
+			int error = 0;
+			int found = 0;
+			unsigned int best = captured;
+			unsigned int c;
+			for (c = captured; c < capture->count; c++)
+			{
+				int32_t offset = (int32_t)(capture->edges[c].tick - capture->edges[start].tick) - expected;
+				if (offset - track > window)
+				{
+					break;
+				}
+				if (capture->edges[c].level == level && (!found || abs(offset - track) < abs(error - track)))
+				{
+					error = offset;
+					best = c;
+					found = 1;
+				}
+			}
+			if (found)
+			{
+				if (matched == 0)
+				{
+					firstError = error;
+				}
+				lastError = error;
+				recent += (error - recent) / 8;
+				sumSquares += (double)error * error;
+				if (abs(error) > result->maxError)
+				{
+					result->maxError = abs(error);
+				}
+				matched++;
+				captured = best + 1;
+			}
+			else
+			{
+				result->droppedEdges++;
+			}
+		}
+		now += irSignal[i].usDelay;
+	}
+
+	result->jitter = matched ? sqrt(sumSquares / matched) : 0;
+	result->drift = lastError - firstError;
+}
+
+// Compare captured edges with the edges irSignal should produce on outPin.
+// The timelines are aligned on the first captured rising edge, taken to be
+// whichever of the first few expected rising edges leaves fewest edges
+// unmatched. An expected edge is matched by the nearest captured edge of
+// the same level within 4x tolerance, the window being capped below half
+// the shortest interval between expected edges of one level (a carrier
+// cycle) so that a dropped cycle cannot make every later edge match the
+// next cycle.
+static inline void irSlingVerifyCapture(const gpioPulse_t *irSignal, unsigned int pulseCount, uint32_t outPin,
+	const irSlingCapture_t *capture, int tolerance, irSlingVerifyResult_t *result)
+{
+	uint32_t mask = 1u << outPin;
+	int window = tolerance * 4;
+	int level = 0;
+	uint32_t now = 0;
+	uint32_t lastEdge[2] = { 0, 0 };
+	int seen[2] = { 0, 0 };
+	uint32_t shortest = 0;
+	unsigned int anchors[IRSLING_VERIFY_ANCHORS];
+	unsigned int numAnchors = 0;
+	unsigned int edge = 0;
+	unsigned int start = 0;
+	unsigned int i;
+
+	// the shortest interval between expected edges of a level bounds the
+	// window, and the first rising edges are the candidate anchors
+	for (i = 0; i < pulseCount; i++)
+	{
+		int next = level;
+		if (irSignal[i].gpioOn & mask) next = 1;
+		if (irSignal[i].gpioOff & mask) next = 0;
+		if (next != level)
+		{
+			level = next;
+			if (seen[level] && (shortest == 0 || now - lastEdge[level] < shortest))
+			{
+				shortest = now - lastEdge[level];
+			}
+			if (level == 1 && numAnchors < IRSLING_VERIFY_ANCHORS)
+			{
+				anchors[numAnchors++] = edge;
+			}
+			lastEdge[level] = now;
+			seen[level] = 1;
+			edge++;
+		}
+		now += irSignal[i].usDelay;
+	}
+	if (shortest > 0 && window > (int)(shortest - 1) / 2)
+	{
+		window = (shortest - 1) / 2;
+	}
+
+	// captured edges before the first rising one cannot be aligned
+	while (start < capture->count && capture->edges[start].level != 1)
+	{
+		start++;
+	}
+
+	irSlingMatchCapture(irSignal, pulseCount, mask, capture, start, 0, window, result);
+	for (i = 1; i < numAnchors && result->droppedEdges > 0; i++)
+	{
+		irSlingVerifyResult_t other;
+		irSlingMatchCapture(irSignal, pulseCount, mask, capture, start, anchors[i], window, &other);
+		if (other.droppedEdges < result->droppedEdges)
+		{
+			*result = other;
+		}
+	}
+	result->withinTolerance = (result->droppedEdges == 0) && (result->maxError <= tolerance);
+}
+
+// Transmit and check what arrived on inPin, retransmitting up to retries
+// times while the frame is out of tolerance (us), capturing into the
+// caller's buffer so nothing is allocated per frame.
+// Returns 0 if a frame was within tolerance, 1 if transmission failed and
+// 2 if every attempt was out of tolerance; result holds the last attempt
+// (all zero if nothing was verified).
+static inline int transmitWaveVerifiedInto(gpioPulse_t *irSignal, unsigned int pulseCount, uint32_t outPin,
+	uint32_t inPin, int tolerance, int retries, irSlingCapture_t *capture, irSlingVerifyResult_t *result)
+{
+	memset(result, 0, sizeof(*result));
+	gpioSetMode(inPin, PI_INPUT);
+
+	int ret = 2;
+	int attempt;
+	for (attempt = 0; attempt <= retries; attempt++)
+	{
+		capture->count = 0;
+		gpioSetAlertFuncEx(inPin, irSlingCaptureEdge, capture);
+		if (transmitWave(irSignal, pulseCount))
+		{
+			ret = 1;
+			break;
+		}
+		// alerts are delivered from a buffer, let the last ones arrive
+		time_sleep(0.01);
+		gpioSetAlertFuncEx(inPin, NULL, NULL);
+
+		irSlingVerifyCapture(irSignal, pulseCount, outPin, capture, tolerance, result);
+		if (result->withinTolerance)
+		{
+			ret = 0;
+			break;
+		}
+	}
+	gpioSetAlertFuncEx(inPin, NULL, NULL);
+	return ret;
+}
+
+// As transmitWaveVerifiedInto(), with a capture buffer allocated for the call.
+static inline int transmitWaveVerified(gpioPulse_t *irSignal, unsigned int pulseCount, uint32_t outPin,
+	uint32_t inPin, int tolerance, int retries, irSlingVerifyResult_t *result)
+{
+	memset(result, 0, sizeof(*result));
+	irSlingCapture_t *capture = (irSlingCapture_t *)malloc(sizeof(irSlingCapture_t));
+	if (capture == NULL)
+	{
+		return 1;
+	}
+	int ret = transmitWaveVerifiedInto(irSignal, pulseCount, outPin, inPin, tolerance, retries, capture, result);
+	free(capture);
+	return ret;
+}
+
+// Trace files, for checking encodings without any hardware
+// Binary trace: "IRSL" and a version byte, then one record per wave of
+//   varint name length, name, varint pulse count, then per pulse
+//   varint (usDelay << 2 | kind) where kind is
+//     0: no pins change
+//     1: same pins as two pulses back (the other half of a carrier cycle)
+//     2: same pins as the previous pulse
+//     3: explicit, followed by varint gpioOn and varint gpioOff
+#define IRSLING_TRACE_VERSION 1
+
+static inline void traceVarint(FILE *out, uint32_t value)
+{
+	while (value >= 0x80)
+	{
+		fputc((value & 0x7f) | 0x80, out);
+		value >>= 7;
+	}
+	fputc(value, out);
+}
+
+static inline int irSlingWriteTraceHeader(FILE *out)
+{
+	fputs("IRSL", out);
+	fputc(IRSLING_TRACE_VERSION, out);
+	return ferror(out) ? 1 : 0;
+}
+
+static inline int irSlingWriteTrace(FILE *out, const char *name, const gpioPulse_t *irSignal, unsigned int pulseCount)
+{
+	size_t nameLen = strlen(name);
+	traceVarint(out, nameLen);
+	fwrite(name, 1, nameLen, out);
+	traceVarint(out, pulseCount);
+
+	unsigned int i;
+	for (i = 0; i < pulseCount; i++)
+	{
+		const gpioPulse_t *p = &irSignal[i];
+		uint32_t kind = 3;
+		if (p->gpioOn == 0 && p->gpioOff == 0)
+		{
+			kind = 0;
+		}
+		else if (i >= 2 && p->gpioOn == irSignal[i-2].gpioOn && p->gpioOff == irSignal[i-2].gpioOff)
+		{
+			kind = 1;
+		}
+		else if (i >= 1 && p->gpioOn == irSignal[i-1].gpioOn && p->gpioOff == irSignal[i-1].gpioOff)
+		{
+			kind = 2;
+		}
+		traceVarint(out, (p->usDelay << 2) | kind);
+		if (kind == 3)
+		{
+			traceVarint(out, p->gpioOn);
+			traceVarint(out, p->gpioOff);
+		}
+	}
+	return ferror(out) ? 1 : 0;
+}
+
+// VCD trace (readable by sigrok, GTKWave etc) with one wire per pin in pins
+static inline int irSlingWriteVCDHeader(FILE *out, uint32_t pins)
+{
+	fprintf(out, "$version irslinger $end\n");
+	fprintf(out, "$timescale 1us $end\n");
+	fprintf(out, "$scope module irslinger $end\n");
+	int pin;
+	for (pin = 0; pin < 32; pin++)
+	{
+		if (pins & (1u << pin))
+		{
+			fprintf(out, "$var wire 1 %c gpio%d $end\n", '!' + pin, pin);
+		}
+	}
+	fprintf(out, "$upscope $end\n");
+	fprintf(out, "$enddefinitions $end\n");
+	fprintf(out, "#0\n$dumpvars\n");
+	for (pin = 0; pin < 32; pin++)
+	{
+		if (pins & (1u << pin))
+		{
+			fprintf(out, "0%c\n", '!' + pin);
+		}
+	}
+	fprintf(out, "$end\n");
+	return ferror(out) ? 1 : 0;
+}
+
+// Write one wave starting at time start (microseconds), all pins low.
+// The encoders always leave the pins low at the end of a wave.
+// *end is set to the time the wave finishes.
+static inline int irSlingWriteVCD(FILE *out, uint32_t pins, const char *name, const gpioPulse_t *irSignal, unsigned int pulseCount, uint64_t start, uint64_t *end)
+{
+	uint64_t now = start;
+	uint32_t level = 0;
+	unsigned int i;
+
+	fprintf(out, "$comment %s $end\n", name);
+	for (i = 0; i < pulseCount; i++)
+	{
+		uint32_t next = (level | irSignal[i].gpioOn) & ~irSignal[i].gpioOff & pins;
+		uint32_t changed = next ^ level;
+		if (changed)
+		{
+			fprintf(out, "#%llu\n", (unsigned long long)now);
+			int pin;
+			for (pin = 0; pin < 32; pin++)
+			{
+				if (changed & (1u << pin))
+				{
+					fprintf(out, "%d%c\n", (next >> pin) & 1, '!' + pin);
+				}
+			}
+			level = next;
+		}
+		now += irSignal[i].usDelay;
+	}
+	if (end)
+	{
+		*end = now;
+	}
+	return ferror(out) ? 1 : 0;
+}
+
 static inline int irSlingPrepareRC5(gpioPulse_t *irSignal,
 	unsigned int * pulseCount,
 	int outPin,
@@ -174,6 +1487,7 @@ static inline int irSlingPrepareRC5(gpioPulse_t *irSignal,
 	}
 
 	// Generate Code
+	IRSLING_PROBE(prepare__start, *pulseCount, pulsesAirtime(irSignal, *pulseCount));
 	int i;
 	for (i = 0; i < codeLen; i++)
 	{
@@ -192,6 +1506,13 @@ static inline int irSlingPrepareRC5(gpioPulse_t *irSignal,
 
 	//printf("pulse count is %i\n", *pulseCount);
 	// End Generate Code
+	IRSLING_PROBE(prepare__done, *pulseCount, pulsesAirtime(irSignal, *pulseCount));
+	if (*pulseCount > MAX_PULSES)
+	{
+		// Too long for the pulse buffer
+		return 1;
+	}
+	return 0;
 }
 
 static inline int irSlingRC5(uint32_t outPin,
@@ -238,6 +1559,7 @@ static inline int irSlingPrepare(gpioPulse_t *irSignal, unsigned int * pulseCoun
 	}
 
 	// Generate Code
+	IRSLING_PROBE(prepare__start, *pulseCount, pulsesAirtime(irSignal, *pulseCount));
 	// insert header
 	if (leadingPulseDuration > 0)
 	{
@@ -272,6 +1594,12 @@ static inline int irSlingPrepare(gpioPulse_t *irSignal, unsigned int * pulseCoun
 
 	//printf("pulse count is %i\n", *pulseCount);
 	// End Generate Code
+	IRSLING_PROBE(prepare__done, *pulseCount, pulsesAirtime(irSignal, *pulseCount));
+	if (*pulseCount > MAX_PULSES)
+	{
+		// Too long for the pulse buffer
+		return 1;
+	}
 	return 0;
 }
 
@@ -323,6 +1651,7 @@ static inline int irSlingPrepareRaw(gpioPulse_t * irSignal, unsigned int * pulse
 		return 1;
 	}
 
+	IRSLING_PROBE(prepare__start, *pulseCount, pulsesAirtime(irSignal, *pulseCount));
 	int i;
 	for (i = 0; i < numPulses; i++)
 	{
@@ -335,8 +1664,208 @@ static inline int irSlingPrepareRaw(gpioPulse_t * irSignal, unsigned int * pulse
 
 	//printf("pulse count is %i from %i\n", *pulseCount, numPulses);
 	// End Generate Code
+	IRSLING_PROBE(prepare__done, *pulseCount, pulsesAirtime(irSignal, *pulseCount));
+	if (*pulseCount > MAX_PULSES)
+	{
+		// Too long for the pulse buffer
+		return 1;
+	}
 	return 0;
 }
+// Packed raw codes. The distinct durations used by a remote are kept once
+// in a timing table and each code is a string of varints (7 bits per byte,
+// least significant first, top bit set on all but the last byte):
+//   even v: the next duration is timings[v >> 1]
+//   odd v:  the last mark/space pair repeats another v >> 1 times
+// Durations alternate mark and space, starting with a mark.
+
+// read one varint, returns 0 at the end of the data or on a bad varint
+static inline int rawPackedNext(const uint8_t *packed, size_t packedLen, size_t *pos, uint32_t *value)
+{
+	uint32_t v = 0;
+	int shift = 0;
+	while (*pos < packedLen && shift < 32)
+	{
+		uint8_t b = packed[(*pos)++];
+		v |= (uint32_t)(b & 0x7f) << shift;
+		if ((b & 0x80) == 0)
+		{
+			*value = v;
+			return 1;
+		}
+		shift += 7;
+	}
+	return 0;
+}
+
+// Call fn(duration, index, context) for every duration of a packed code.
+// Returns the number of durations, or -1 if the code is corrupt.
+static inline int irSlingUnpackRaw(const uint32_t *timings, size_t numTimings,
+	const uint8_t *packed, size_t packedLen,
+	void (*fn)(uint32_t duration, int index, void *context), void *context)
+{
+	size_t pos = 0;
+	// end of the last whole varint, to spot one cut short
+	size_t end = 0;
+	int n = 0;
+	uint32_t last[2] = { 0, 0 };
+	uint32_t v;
+	while (rawPackedNext(packed, packedLen, &pos, &v))
+	{
+		end = pos;
+		if ((v & 1) == 0)
+		{
+			if ((v >> 1) >= numTimings)
+			{
+				return -1;
+			}
+			last[n % 2] = timings[v >> 1];
+			fn(last[n % 2], n, context);
+			n++;
+			continue;
+		}
+		if (n < 2 || n % 2 != 0)
+		{
+			return -1;
+		}
+		uint32_t repeat;
+		for (repeat = v >> 1; repeat > 0; repeat--)
+		{
+			fn(last[0], n++, context);
+			fn(last[1], n++, context);
+		}
+	}
+	return ((pos == packedLen) && (end == pos)) ? n : -1;
+}
+
+// write one varint, returns 0 if it does not fit
+static inline int rawPackedPut(uint8_t *packed, size_t packedMax, size_t *pos, uint32_t value)
+{
+	while (value >= 0x80)
+	{
+		if (*pos >= packedMax)
+		{
+			return 0;
+		}
+		packed[(*pos)++] = (uint8_t)((value & 0x7f) | 0x80);
+		value >>= 7;
+	}
+	if (*pos >= packedMax)
+	{
+		return 0;
+	}
+	packed[(*pos)++] = (uint8_t)value;
+	return 1;
+}
+
+// Pack count durations against a timing table of at most maxTimings
+// entries, adding any durations it does not hold yet. The packed code
+// takes at most 5 bytes per duration. Returns the length of the packed
+// code, or -1 if the table or packed buffer is too small.
+static inline int irSlingPackRaw(const int *durations, size_t count,
+	uint32_t *timings, size_t *numTimings, size_t maxTimings,
+	uint8_t *packed, size_t packedMax)
+{
+	size_t pos = 0;
+	size_t i = 0;
+	while (i < count)
+	{
+		// at a pair boundary, count repeats of the previous mark/space pair
+		size_t run = 0;
+		if ((i >= 2) && (i % 2 == 0))
+		{
+			while ((i + 2*run + 1 < count) &&
+			       (durations[i + 2*run] == durations[i - 2]) &&
+			       (durations[i + 2*run + 1] == durations[i - 1]))
+			{
+				run++;
+			}
+		}
+		if (run > 0)
+		{
+			if (!rawPackedPut(packed, packedMax, &pos, (uint32_t)((run << 1) | 1)))
+			{
+				return -1;
+			}
+			i += 2*run;
+			continue;
+		}
+
+		size_t index;
+		for (index = 0; index < *numTimings; index++)
+		{
+			if (timings[index] == (uint32_t)durations[i])
+			{
+				break;
+			}
+		}
+		if (index == *numTimings)
+		{
+			if (*numTimings >= maxTimings)
+			{
+				return -1;
+			}
+			timings[(*numTimings)++] = (uint32_t)durations[i];
+		}
+		if (!rawPackedPut(packed, packedMax, &pos, (uint32_t)(index << 1)))
+		{
+			return -1;
+		}
+		i++;
+	}
+	return (int)pos;
+}
+
+typedef struct
+{
+	gpioPulse_t *irSignal;
+	unsigned int *pulseCount;
+	uint32_t outPin;
+	int frequency;
+	double dutyCycle;
+} rawPackedTarget_t;
+
+static inline void rawPackedPulse(uint32_t duration, int index, void *context)
+{
+	rawPackedTarget_t *target = (rawPackedTarget_t *)context;
+	if (index % 2 == 0) {
+		carrierFrequency(target->outPin, target->frequency, target->dutyCycle, duration, target->irSignal, target->pulseCount);
+	} else {
+		gap(target->outPin, duration, target->irSignal, target->pulseCount);
+	}
+}
+
+// As irSlingPrepareRaw, decoding a packed code straight into irSignal
+static inline int irSlingPrepareRawPacked(gpioPulse_t * irSignal, unsigned int * pulseCount, uint32_t outPin,
+	int frequency,
+	double dutyCycle,
+	const uint32_t *timings,
+	size_t numTimings,
+	const uint8_t *packed,
+	size_t packedLen)
+{
+	if (outPin > 31)
+	{
+		// Invalid pin number
+		return 1;
+	}
+
+	IRSLING_PROBE(prepare__start, *pulseCount, pulsesAirtime(irSignal, *pulseCount));
+	rawPackedTarget_t target = { irSignal, pulseCount, outPin, frequency, dutyCycle };
+	if (irSlingUnpackRaw(timings, numTimings, packed, packedLen, rawPackedPulse, &target) < 0)
+	{
+		// Corrupt code
+		return 1;
+	}
+	IRSLING_PROBE(prepare__done, *pulseCount, pulsesAirtime(irSignal, *pulseCount));
+	if (*pulseCount > MAX_PULSES)
+	{
+		// Too long for the pulse buffer
+		return 1;
+	}
+	return 0;
+}
+
 static inline int irSlingRaw(uint32_t outPin,
 	int frequency,
 	double dutyCycle,
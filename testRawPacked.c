@@ -0,0 +1,98 @@
+#include <stdio.h>
+#include "irslinger.h"
+
+// Checks that raw codes packed with irSlingPackRaw() unpack to exactly the
+// durations they were packed from. Needs no IR hardware.
+
+typedef struct
+{
+	const int *expected;
+	int count;
+	int mismatches;
+} unpackCheck_t;
+
+static void checkDuration(uint32_t duration, int index, void *context)
+{
+	unpackCheck_t *check = (unpackCheck_t *)context;
+	if ((index >= check->count) || (duration != (uint32_t)check->expected[index]))
+	{
+		check->mismatches++;
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	// repeated mark/space pairs, to be run-length encoded
+	int nec[] = {
+		9000, 4500, 560, 560, 560, 560, 560, 560, 560, 1690, 560, 1690, 560, 1690,
+		560, 560, 560, 560, 560, 1690, 560, 560, 560, 560, 560, 560, 560, 560, 560};
+	// odd length, ending on a mark
+	int odd[] = { 3500, 1750, 450, 1300, 450 };
+	// a single mark, and long durations
+	int single[] = { 600 };
+	int wide[] = { 70000, 200, 1000000, 200, 70000, 200, 1000000, 200 };
+	// the same code as nec, packed against the same timing table
+	const int *codes[] = { nec, odd, single, wide, nec };
+	int counts[] = {
+		sizeof(nec) / sizeof(int), sizeof(odd) / sizeof(int), sizeof(single) / sizeof(int),
+		sizeof(wide) / sizeof(int), sizeof(nec) / sizeof(int) };
+	int numCodes = sizeof(counts) / sizeof(int);
+
+	uint32_t timings[32];
+	size_t numTimings = 0;
+	uint8_t packed[5][256];
+	int packedLen[5];
+	int failed = 0;
+	int i;
+
+	for (i = 0; i < numCodes; i++)
+	{
+		packedLen[i] = irSlingPackRaw(codes[i], counts[i], timings, &numTimings, 32, packed[i], sizeof(packed[i]));
+		if (packedLen[i] < 0)
+		{
+			printf("code %d: packing failed\n", i);
+			failed = 1;
+		}
+	}
+
+	for (i = 0; i < numCodes; i++)
+	{
+		unpackCheck_t check = { codes[i], counts[i], 0 };
+		int n = irSlingUnpackRaw(timings, numTimings, packed[i], packedLen[i], checkDuration, &check);
+		if ((n != counts[i]) || check.mismatches)
+		{
+			printf("code %d: unpacked %d of %d durations, %d wrong\n", i, n, counts[i], check.mismatches);
+			failed = 1;
+		}
+	}
+
+	// identical codes pack identically, so they can be shared
+	if ((packedLen[0] != packedLen[4]) || memcmp(packed[0], packed[4], packedLen[0]))
+	{
+		printf("identical codes packed differently\n");
+		failed = 1;
+	}
+	// the repeats in nec must actually have been run-length encoded
+	if (packedLen[0] >= counts[0])
+	{
+		printf("nec code not run-length encoded (%d bytes)\n", packedLen[0]);
+		failed = 1;
+	}
+
+	// corrupt codes are rejected: an index past the timing table, a repeat
+	// with no pair before it, and a varint cut short
+	uint8_t badIndex[] = { (uint8_t)(numTimings << 1) };
+	uint8_t badRepeat[] = { 0, 3 };
+	uint8_t badVarint[] = { 0x80 };
+	unpackCheck_t check = { nec, counts[0], 0 };
+	if ((irSlingUnpackRaw(timings, numTimings, badIndex, sizeof(badIndex), checkDuration, &check) >= 0) ||
+	    (irSlingUnpackRaw(timings, numTimings, badRepeat, sizeof(badRepeat), checkDuration, &check) >= 0) ||
+	    (irSlingUnpackRaw(timings, numTimings, badVarint, sizeof(badVarint), checkDuration, &check) >= 0))
+	{
+		printf("corrupt code accepted\n");
+		failed = 1;
+	}
+
+	printf("%s\n", failed ? "FAILED" : "OK");
+	return failed;
+}